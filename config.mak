@@ -35,6 +35,10 @@ MY_LDFLAGS ?=
 
 DEBUG ?= false
 
+# Use the multi-arena allocator in src/sgx/enclave_malloc.c instead of musl's
+# malloc for enclave applications
+ARENA_MALLOC ?= false
+
 MUSL_CONFIGURE_OPTS ?=
 MUSL_CFLAGS ?= -fPIC -D__USE_GNU
 
@@ -46,3 +50,7 @@ else
 	MUSL_CFLAGS += -O3
 	MY_CFLAGS += -O3
 endif
+
+ifeq ($(ARENA_MALLOC),true)
+	MUSL_CFLAGS += -DSGXLKL_ARENA_MALLOC
+endif
@@ -15,6 +15,7 @@
 #define _GNU_SOURCE
 #include <sys/mman.h>
 
+#include "enclave_string.h"
 #include "lthread.h"
 #include "pthread_impl.h"
 #include "ticketlock.h"
@@ -89,7 +90,7 @@ int deepinitiovec(Arena *a, struct iovec *dst, const struct iovec *src) {
 
 void deepcopyiovec(struct iovec *dst, const struct iovec *src) {
     if (dst->iov_len != src->iov_len) {*(int *)NULL = 0;}
-    memcpy(dst->iov_base, src->iov_base, src->iov_len);
+    enclave_memcpy(dst->iov_base, src->iov_base, src->iov_len);
     dst->iov_len = src->iov_len;
 }
 
@@ -20,7 +20,9 @@
 #include <sys/mman.h>
 
 #include "atomic.h"
+#include "enclave_string.h"
 #include "hostcall_interface.h"
+#include "lthread.h"
 
 int host_syscall_SYS_close(int fd) {
     volatile syscall_t *sc;
@@ -276,7 +278,7 @@ ssize_t host_syscall_SYS_pread64(int fd, void * buf, size_t count, off_t offset)
     sc->arg4 = (uintptr_t)offset;
     threadswitch((syscall_t*) sc);
     __syscall_return_value = (ssize_t)sc->ret_val;
-    if (val2 != NULL && buf != NULL) memcpy(buf, val2, len2);
+    if (val2 != NULL && buf != NULL) enclave_memcpy(buf, val2, len2);
     arena_free(a);
     sc->status = 0;
     return (ssize_t)__syscall_return_value;
@@ -294,7 +296,7 @@ ssize_t host_syscall_SYS_pwrite64(int fd, const void * buf, size_t count, off_t
     sc->arg1 = (uintptr_t)fd;
     void * val2;
     val2 = arena_alloc(a, len2);
-    if (buf != NULL && val2 != NULL) memcpy(val2, buf, len2);
+    if (buf != NULL && val2 != NULL) enclave_memcpy_out(val2, buf, len2);
     sc->arg2 = (uintptr_t)val2;
     sc->arg3 = (uintptr_t)count;
     sc->arg4 = (uintptr_t)offset;
@@ -321,7 +323,7 @@ ssize_t host_syscall_SYS_read(int fd, void * buf, size_t count) {
     sc->arg3 = (uintptr_t)count;
     threadswitch((syscall_t*) sc);
     __syscall_return_value = (ssize_t)sc->ret_val;
-    if (val2 != NULL && buf != NULL) memcpy(buf, val2, len2);
+    if (val2 != NULL && buf != NULL) enclave_memcpy(buf, val2, len2);
     arena_free(a);
     sc->status = 0;
     return (ssize_t)__syscall_return_value;
@@ -363,7 +365,7 @@ ssize_t host_syscall_SYS_write(int fd, const void * buf, size_t count) {
     sc->arg1 = (uintptr_t)fd;
     void * val2;
     val2 = arena_alloc(a, len2);
-    if (buf != NULL && val2 != NULL) memcpy(val2, buf, len2);
+    if (buf != NULL && val2 != NULL) enclave_memcpy_out(val2, buf, len2);
     sc->arg2 = (uintptr_t)val2;
     sc->arg3 = (uintptr_t)count;
     threadswitch((syscall_t*) sc);
@@ -462,6 +464,12 @@ int host_syscall_SYS_munlockall() {
 }
 
 int host_syscall_SYS_mprotect(void * addr, size_t len, int prot) {
+    /* Protection changes of enclave memory are handled within the enclave
+     * (see syscall_SYS_mprotect), which passes others on to the host. */
+    return syscall_SYS_mprotect(addr, len, prot);
+}
+
+int host_syscall_SYS_mprotect_raw(void * addr, size_t len, int prot) {
     volatile syscall_t *sc;
     volatile intptr_t __syscall_return_value;
     Arena *a = NULL;
@@ -482,6 +490,35 @@ int host_syscall_SYS_mprotect(void * addr, size_t len, int prot) {
     return (int)__syscall_return_value;
 }
 
+int host_syscall_SYS_madvise(void * addr, size_t length, int advice) {
+    volatile syscall_t *sc;
+    volatile intptr_t __syscall_return_value;
+    Arena *a = NULL;
+    sc = getsyscallslot(&a);
+    sc->syscallno = SYS_madvise;
+    sc->arg1 = (uintptr_t)addr;
+    sc->arg2 = (uintptr_t)length;
+    sc->arg3 = (uintptr_t)advice;
+    threadswitch((syscall_t*) sc);
+    __syscall_return_value = (int)sc->ret_val;
+    sc->status = 0;
+    return (int)__syscall_return_value;
+}
+
+int host_syscall_SYS_membarrier(int cmd, int flags) {
+    volatile syscall_t *sc;
+    volatile intptr_t __syscall_return_value;
+    Arena *a = NULL;
+    sc = getsyscallslot(&a);
+    sc->syscallno = SYS_membarrier;
+    sc->arg1 = (uintptr_t)cmd;
+    sc->arg2 = (uintptr_t)flags;
+    threadswitch((syscall_t*) sc);
+    __syscall_return_value = (int)sc->ret_val;
+    sc->status = 0;
+    return (int)__syscall_return_value;
+}
+
 int host_syscall_SYS_rt_sigaction(int signum, struct sigaction * act, struct sigaction * oldact, unsigned long nsig) {
     volatile syscall_t *sc;
     volatile intptr_t __syscall_return_value;
@@ -646,6 +683,11 @@ int host_syscall_SYS_nanosleep(const struct timespec * req, struct timespec * re
     volatile syscall_t *sc;
     volatile intptr_t __syscall_return_value;
     Arena *a = NULL;
+    /* Sleep within the enclave if possible (see syscall_SYS_clock_nanosleep)
+     * instead of blocking a host syscall thread. */
+    struct lthread *lt = lthread_self();
+    if (lt != NULL && !(lt->attr.state & BIT(LT_ST_PINNED)))
+        return syscall_SYS_nanosleep(req, rem);
     sc = getsyscallslot(&a);
     size_t len1;
     len1 = sizeof(*req);
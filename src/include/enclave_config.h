@@ -21,6 +21,9 @@
 #define SGXLKL_HW_MODE  0
 #define SGXLKL_SIM_MODE 1
 
+/* CPU features detected by the host (cpu_features) */
+#define SGXLKL_CPU_ERMS (1 << 0) /* Enhanced rep movsb/stosb */
+
 typedef struct {
     uintptr_t arg1;
     uintptr_t arg2;
@@ -79,8 +82,19 @@ typedef struct enclave_config {
     void *shm_out_to_enc;
     int mode; /* SGXLKL_HW_MODE or SGXLKL_SIM_MODE */
     void *vvar;
+    size_t ethreads; /* Number of enclave threads */
+    size_t kernel_ethreads; /* Number of enclave threads reserved for LKL kernel threads */
+    int ethreads_park; /* Park idle enclave threads */
+    volatile int ethreads_park_word; /* Futex word parked enclave threads wait on */
+    volatile int ethreads_unpark; /* Number of parked enclave threads the host syscall threads are asked to wake (HW mode) */
+    uint64_t timeslice; /* lthread timeslice in us for run-time accounting (0: disabled) */
+    size_t kernel_mem; /* LKL kernel memory in bytes (0: build-time default BOOT_MEM) */
+    uint32_t cpu_features; /* SGXLKL_CPU_* flags */
 } enclave_config_t;
 
+/* Parked enclave threads recheck the scheduler queue after this timeout */
+#define SGXLKL_ETHREAD_PARK_TIMEOUT_NS 100000000
+
 enum SlotState { DONE, WRITTEN };
 enum Pointers { READ_P, READY_P, WRITE_P};
 
@@ -139,6 +153,7 @@ typedef enum { ACTIVE = 0, OUTSIDE = 1, UNUSED = 2, AVAILABLE = 3 } thread_state
 #define SGXLKL_EXIT_SLEEP            3
 #define SGXLKL_EXIT_CPUID            4
 #define SGXLKL_EXIT_DORESUME         5
+#define SGXLKL_EXIT_PARK             6
 
 /* Error codes */
 #define SGXLKL_UNEXPECTED_CALLID     1
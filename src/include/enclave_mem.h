@@ -5,9 +5,32 @@
 #ifndef ENCLAVE_MEM_H
 #define ENCLAVE_MEM_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+/* Enclave memory statistics, see enclave_mem_get_stats() */
+struct enclave_mem_stats {
+    size_t total_pages;            /* Pages available to mmap */
+    size_t used_pages;             /* Pages currently mapped */
+    size_t max_used_pages;         /* Maximum number of pages mapped at a time */
+    size_t free_extents;           /* Number of free ranges (fragmentation) */
+    size_t largest_free_extent;    /* Pages in the largest free range */
+    uint64_t mmaps;                /* Successful mmap calls */
+    uint64_t mmap_failures;        /* Failed mmap calls */
+    uint64_t munmaps;              /* munmap calls */
+    uint64_t mremaps_in_place;     /* mremap calls resized without moving */
+    uint64_t mremaps_copied;       /* mremap calls moved to a new range */
+    uint64_t mremap_copied_bytes;  /* Bytes copied by moving mremap calls */
+    uint64_t zeroed_pages;         /* Pages zeroed on mmap, mprotect and madvise */
+    uint64_t zeroed_idle_pages;    /* Pages zeroed by idle ethreads */
+};
+
 void enclave_mman_init(void *base, size_t num_pages);
 void* enclave_mmap(void *addr, size_t length, int mmap_fixed);
 int enclave_munmap(void *addr, size_t length);
-void* enclave_mremap(void *old_addr, size_t old_length, void *new_addr, size_t new_length, int mremap_fixed);
+void* enclave_mremap(void *old_addr, size_t old_length, void *new_addr, size_t new_length, int mremap_fixed, int mremap_maymove);
+void enclave_mmap_zero_idle(void);
+void enclave_mem_get_stats(struct enclave_mem_stats *stats);
+long enclave_mmap_file_io(long no, long *params);
 
 #endif /* ENCLAVE_MEM_H */
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2016, 2017, 2018 Imperial College London
+ */
+
+#ifndef ENCLAVE_STRING_H
+#define ENCLAVE_STRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Copy and fill routines for large buffers, e.g. host system call buffers
+ * and pages of enclave memory. Smaller sizes use the regular libc functions.
+ */
+
+/* Minimum size for which rep movsb/stosb is used if the CPU supports ERMS */
+#define ENCLAVE_STRING_REP_THRESHOLD 2048
+/* Minimum size of copies to host memory that bypass the cache */
+#define ENCLAVE_STRING_NT_THRESHOLD  (256 * 1024)
+
+void enclave_string_init(uint32_t cpu_features);
+void *enclave_memcpy_rep(void *dst, const void *src, size_t n);
+void *enclave_memset_rep(void *dst, int c, size_t n);
+void *enclave_memcpy_nt(void *dst, const void *src, size_t n);
+
+static inline void *enclave_memcpy(void *dst, const void *src, size_t n) {
+    if (n < ENCLAVE_STRING_REP_THRESHOLD)
+        return memcpy(dst, src, n);
+    return enclave_memcpy_rep(dst, src, n);
+}
+
+static inline void *enclave_memset(void *dst, int c, size_t n) {
+    if (n < ENCLAVE_STRING_REP_THRESHOLD)
+        return memset(dst, c, n);
+    return enclave_memset_rep(dst, c, n);
+}
+
+/*
+ * Copies a buffer to host memory that the enclave does not read again. Large
+ * copies use non-temporal stores so that they do not evict enclave data from
+ * the cache.
+ */
+static inline void *enclave_memcpy_out(void *dst, const void *src, size_t n) {
+    if (n < ENCLAVE_STRING_NT_THRESHOLD)
+        return enclave_memcpy(dst, src, n);
+    return enclave_memcpy_nt(dst, src, n);
+}
+
+#endif /* ENCLAVE_STRING_H */
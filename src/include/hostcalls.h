@@ -14,6 +14,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <poll.h>
+#include <sched.h>
 
 #include "hostcall_interface.h"
 
@@ -33,8 +34,11 @@ int host_syscall_SYS_fstat(int fd, struct stat *buf);
 pid_t host_syscall_SYS_gettid(void);
 int host_syscall_SYS_ioctl(int fd, unsigned long request, void *arg);
 off_t host_syscall_SYS_lseek(int fd, off_t offset, int whence);
+int host_syscall_SYS_madvise(void *addr, size_t length, int advice);
+int host_syscall_SYS_membarrier(int cmd, int flags);
 void *host_syscall_SYS_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
 int host_syscall_SYS_mprotect(void *addr, size_t len, int prot);
+int host_syscall_SYS_mprotect_raw(void *addr, size_t len, int prot);
 void *host_syscall_SYS_mremap(void *old_address, size_t old_size, size_t new_size, int flags, void *new_address);
 int host_syscall_SYS_munmap(void *addr, size_t length);
 int host_syscall_SYS_msync(void *addr, size_t length, int flags);
@@ -71,7 +75,30 @@ long host_syscall_SYS_set_tid_address(int *tidptr);
 int syscall_SYS_futex(int *uaddr, int op, int val, const struct timespec *timeout, int *uaddr2, int val3);
 void *syscall_SYS_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
 void *syscall_SYS_mremap(void *old_address, size_t old_size, size_t new_size, int flags, void *new_address);
+int syscall_SYS_mprotect(void *addr, size_t length, int prot);
 int syscall_SYS_msync(void *addr, size_t length, int flags);
 int syscall_SYS_munmap(void *addr, size_t length);
+int syscall_SYS_nanosleep(const struct timespec *req, struct timespec *rem);
+
+/*
+ * Handled within enclave instead of by LKL, lkl_syscall() in src/lkl/syscall.c
+ * routes these system calls here.
+ */
+int syscall_SYS_sched_setscheduler(pid_t pid, int policy, const struct sched_param *param);
+int syscall_SYS_sched_getscheduler(pid_t pid);
+int syscall_SYS_sched_setaffinity(pid_t pid, size_t cpusetsize, const cpu_set_t *mask);
+int syscall_SYS_sched_getaffinity(pid_t pid, size_t cpusetsize, cpu_set_t *mask);
+int syscall_SYS_membarrier(int cmd, int flags);
+int syscall_SYS_sched_getparam(pid_t pid, struct sched_param *param);
+int syscall_SYS_sched_setparam(pid_t pid, const struct sched_param *param);
+int syscall_SYS_sched_get_priority_max(int policy);
+int syscall_SYS_sched_get_priority_min(int policy);
+int syscall_SYS_sched_rr_get_interval(pid_t pid, struct timespec *ts);
+int syscall_SYS_sched_yield(void);
+int syscall_SYS_getcpu(unsigned *cpu, unsigned *node, void *tcache);
+pid_t syscall_SYS_getpid(void);
+pid_t syscall_SYS_gettid(void);
+int syscall_SYS_clock_nanosleep(clockid_t clk, int flags, const struct timespec *req, struct timespec *rem);
+int syscall_SYS_madvise(void *addr, size_t length, int advice);
 
 #endif /* HOSTCALLS_H */
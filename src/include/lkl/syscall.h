@@ -0,0 +1,16 @@
+/*
+ * Copyright 2016, 2017, 2018 Imperial College London
+ */
+
+#ifndef _MUSLKL_SYSCALL_H
+#define _MUSLKL_SYSCALL_H
+
+/*
+ * lkl_syscall() of liblkl.a, which is renamed when LKL is built so that
+ * system calls pass through the lkl_syscall() of src/lkl/syscall.c first.
+ * Code in SGX-LKL that needs LKL's answer for a system call served within
+ * the enclave calls this directly.
+ */
+long lkl_syscall_lkl(long no, long *params);
+
+#endif
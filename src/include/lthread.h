@@ -50,6 +50,14 @@
 #define CLOCK_LTHREAD CLOCK_REALTIME
 
 struct mpmcq __scheduler_queue;
+/* queue for lthreads with LTHREAD_PRIO_HIGH, see __scheduler_enqueue() */
+extern struct mpmcq __scheduler_queue_prio;
+/* queue for LKL kernel lthreads if ethreads are reserved for them */
+extern struct mpmcq __scheduler_queue_kernel;
+
+/* Scheduling priority classes */
+#define LTHREAD_PRIO_NORMAL 0
+#define LTHREAD_PRIO_HIGH   1
 
 typedef void *(*lthread_func)(void *);
 
@@ -79,6 +87,20 @@ enum lthread_st {
     LT_ST_CANCELSTATE,    /* lthread cancellation has been disabled */
     LT_ST_CANCEL_DISABLED,     /* lthread cancellation has been deferred */
     LT_ST_PINNED, /* lthread pinned to ethread */
+    LT_ST_KERNEL, /* LKL kernel lthread */
+};
+
+/*
+ * Values of the first LTHREAD_TLS_DIRECT_KEYS TLS keys are stored in an array
+ * indexed by the key. Values of all other keys are kept in a list. Direct keys
+ * are reused after deletion; a value only belongs to the current key of its
+ * slot if the generation it was set with matches.
+ */
+#define LTHREAD_TLS_DIRECT_KEYS 128
+
+struct lthread_tls_direct {
+    void *data;
+    int gen;
 };
 
 struct lthread_tls {
@@ -98,7 +120,9 @@ LIST_HEAD(lthread_tlsdestr_l, lthread_tls_destructors);
 struct lthread_attr {
     size_t                  stack_size;      /* current stack_size */
     size_t                  last_stack_size; /* last yield  stack_size */
+    size_t                  max_stack_size;  /* max stack_size seen at yield */
     int                     state;           /* current lthread state */
+    int                     priority;        /* LTHREAD_PRIO_* */
     void                    *stack;          /* ptr to lthread_stack */
 };
 
@@ -129,6 +153,9 @@ struct lthread {
     size_t                  syscall;        /* slot for syscalls */
     Arena                   syscallarena;   /* syscall buffer arena */
     struct lthread_attr     attr;           /* various attributes */
+    int                     stack_owned;    /* stack mapped by lthread_create */
+    int                     affinity;       /* bound to ethread affinity - 1 */
+    struct lthread          *cache_next;    /* next shell in spawn cache */
     struct __ptcb           *cancelbuf;     /* cancellation buffer */
     int                     tid;            /* lthread id */
     char                    funcname[64];   /* optional func name */
@@ -136,9 +163,15 @@ struct lthread {
     void                    **lt_exit_ptr;  /* exit ptr for lthread_join */
     locale_t                locale;         /* locale of current lthread */
     uint32_t                ops;            /* num of ops since yield */
+    uint64_t                resumed_usecs;  /* time of last resume */
+    uint64_t                run_usecs;      /* total time spent running */
+    uint64_t                slice_reported; /* longest reported timeslice overrun */
+    uint64_t                slice_overrun;  /* timeslice overrun yet to be reported */
     uint64_t                sleep_usecs;    /* how long lthread is sleeping */
+    int                     wakeup_pending; /* lthread_wakeup() while awake */
     FILE*                   stdio_locks;    /* locked files */
     struct lthread_tls_l    tls;            /* pointer to TLS */
+    struct lthread_tls_direct *tls_direct;  /* values of direct TLS keys */
     uint8_t                 *itls;          /* image TLS */
     size_t                  itlssz;         /* size of TLS image */
     RB_ENTRY(lthread)       sleep_node;     /* sleep tree node pointer */
@@ -176,10 +209,13 @@ struct lthread_sched {
     size_t              stack_size;
     uint64_t            default_timeout;
     int                 page_size;
+    int                 ethread_id;
     size_t              syscall;
     Arena               arena;
     /* convenience data maintained by lthread_resume */
     struct lthread      *current_lthread;
+    volatile int        current_tid;        /* tid of current_lthread, 0 if none */
+    volatile uint64_t   passes;             /* lthreads switched out, see membarrier */
     size_t              current_syscallslot;
     Arena               *current_arena;
 };
@@ -206,10 +242,64 @@ extern "C" {
     struct lthread* lthread_self(void);
     int     lthread_setcancelstate(int, int*);
     void    lthread_set_expired(struct lthread *lt);
+    int     lthread_setpriority(struct lthread *lt, int priority);
+    int     lthread_setaffinity(struct lthread *lt, int ethread);
+    void    lthread_yield_point(void);
+    int     lthread_sched_owner_running(int tid);
+
+    void    lthread_sched_ethreads_init(enclave_config_t *encl);
+    void    lthread_sched_unpark(void);
+    void    lthread_sched_unpark_ethread(int ethread);
+
+    /* number of ethreads currently parked, see lthread_sched_ethreads_init() */
+    extern volatile int __parked_ethreads;
+    /* number of ethreads reserved for LKL kernel lthreads */
+    extern int __kernel_ethreads;
+    /* per-ethread queues for lthreads bound to an ethread */
+    extern struct mpmcq *__ethread_queues;
+
+    static inline size_t __mpmcq_depth(struct mpmcq *q) {
+        size_t enq = __atomic_load_n(&q->enqueue_pos, __ATOMIC_SEQ_CST);
+        size_t deq = __atomic_load_n(&q->dequeue_pos, __ATOMIC_SEQ_CST);
+        return enq > deq ? enq - deq : 0;
+    }
+
+    static inline size_t __scheduler_queue_depth(void) {
+        return __mpmcq_depth(&__scheduler_queue) + __mpmcq_depth(&__scheduler_queue_prio);
+    }
 
+    /*
+     * High priority lthreads go to the priority queue, which is dequeued
+     * first. If it is full, they are queued as normal lthreads.
+     */
     static inline void __scheduler_enqueue(struct lthread *lt) {
         if (!lt) {a_crash();}
+        /*
+         * Bound lthreads go to the queue of their ethread, which may be parked.
+         * If that queue is full, they are queued like any other lthread and
+         * may run on any ethread, as the enqueuer may be the bound ethread
+         * itself.
+         */
+        if (lt->affinity && __ethread_queues &&
+                mpmc_enqueue(&__ethread_queues[lt->affinity - 1], lt)) {
+            if (__parked_ethreads)
+                lthread_sched_unpark_ethread(lt->affinity - 1);
+            return;
+        }
+        /*
+         * Only reserved ethreads dequeue kernel lthreads, and the enqueuer
+         * may be one of them. If the kernel queue is full, the lthread is
+         * queued like any other and may run on any ethread.
+         */
+        if (__kernel_ethreads && (lt->attr.state & (1 << LT_ST_KERNEL)) &&
+                mpmc_enqueue(&__scheduler_queue_kernel, lt))
+            return;
+        if (lt->attr.priority == LTHREAD_PRIO_HIGH && mpmc_enqueue(&__scheduler_queue_prio, lt))
+            goto enqueued;
         for (;!mpmc_enqueue(&__scheduler_queue, lt);) a_spin();
+enqueued:
+        if (__parked_ethreads)
+            lthread_sched_unpark();
     }
 
 #ifdef __cplusplus
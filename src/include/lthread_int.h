@@ -58,7 +58,7 @@ void        _lthread_yield(struct lthread *lt);
 void        _lthread_yield_cb(struct lthread *lt, void (*f)(void*), void *arg);
 void        _lthread_free(struct lthread *lt);
 void        _lthread_desched_sleep(struct lthread *lt);
-//void        _lthread_sched_sleep(struct lthread *lt, uint64_t msecs);
+void        _lthread_sched_sleep(struct lthread *lt, uint64_t usecs);
 
 int         _save_exec_state(struct lthread *lt);
 void print_timestamp(char *);
@@ -3,6 +3,7 @@
  */
 
 #include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/time.h>
 #include <time.h>
@@ -21,6 +22,10 @@
 #include <lkl_host.h>
 #include "lkl/iomem.h"
 #include "lkl/jmp_buf.h"
+#include "lthread.h"
+#include "lthread_int.h"
+#include "ticketlock.h"
+#include "tree.h"
 
 /* Let's see if the host has semaphore.h */
 #include <unistd.h>
@@ -191,11 +196,36 @@ static void mutex_free(struct lkl_mutex *_mutex) {
     free(_mutex);
 }
 
+struct thread_create_args {
+    void (*fn)(void *);
+    void *arg;
+};
+
+/*
+ * LKL kernel threads are scheduled before application lthreads and run on the
+ * reserved ethreads if there are any (SGXLKL_KERNEL_ETHREADS).
+ */
+static void *kernel_thread_start(void *_args) {
+    struct thread_create_args args = *(struct thread_create_args *)_args;
+    free(_args);
+    /* other ethreads may update the state concurrently, e.g. on wakeup */
+    a_or(&lthread_self()->attr.state, BIT(LT_ST_KERNEL));
+    lthread_setpriority(lthread_self(), LTHREAD_PRIO_HIGH);
+    args.fn(args.arg);
+    return NULL;
+}
+
 static lkl_thread_t thread_create(void (*fn)(void *), void *arg) {
     pthread_t thread;
-    if (WARN_PTHREAD(pthread_create(&thread, NULL, (void* (*)(void *))fn, arg)))
+    struct thread_create_args *args = malloc(sizeof(*args));
+    if (!args)
         return 0;
-    else
+    args->fn = fn;
+    args->arg = arg;
+    if (WARN_PTHREAD(pthread_create(&thread, NULL, kernel_thread_start, args))) {
+        free(args);
+        return 0;
+    } else
         return (lkl_thread_t) thread;
 }
 
@@ -254,69 +284,104 @@ static unsigned long long time_ns(void) {
     return 1e9*ts.tv_sec + ts.tv_nsec;
 }
 
+static unsigned long long monotonic_ns(void) {
+    struct timespec ts = {0};
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        panic();
+    return NSEC_PER_SEC * ts.tv_sec + ts.tv_nsec;
+}
+
+/*
+ * LKL timers are serviced by a single lthread instead of a thread per timer.
+ * Armed timers are kept in a tree ordered by their expiry time. The timer
+ * service sleeps on the scheduler's sleep tree until the earliest timer
+ * expires and then runs the callbacks of all expired timers. (Re-)arming a
+ * timer only updates the tree and, if the timer is now the first to expire,
+ * wakes up the timer service.
+ */
+
+/* Upper bound on how long the timer service sleeps if no timer is armed. */
+#define TIMER_SERVICE_MAX_SLEEP_US 1000000
+
 typedef struct sgx_lkl_timer {
     void (*callback_fn)(void*);
     void *callback_arg;
-    unsigned long long delay_ns;
-    unsigned long long next_delay_ns;
-    pthread_t thread;
-    pthread_mutex_t mtx;
-    pthread_cond_t cv;
+    unsigned long long expiry_ns;
     int armed;
+    RB_ENTRY(sgx_lkl_timer) node;
 } sgx_lkl_timer;
 
-static void* timer_callback(void *_timer) {
-    sgx_lkl_timer *timer = (sgx_lkl_timer*)_timer;
-    int rc,res;
-
-    struct timespec timeout;
-    struct timespec now;
-    if (timer == NULL || timer->callback_fn == NULL) {
-        fprintf(stderr, "WARN: timer_callback() called with unitialised timer.\n");
-        pthread_exit(NULL);
-    }
+static int timer_cmp(sgx_lkl_timer *t1, sgx_lkl_timer *t2) {
+    if (t1->expiry_ns != t2->expiry_ns)
+        return t1->expiry_ns < t2->expiry_ns ? -1 : 1;
+    /* timers with the same expiry time are ordered by address */
+    if (t1 != t2)
+        return t1 < t2 ? -1 : 1;
+    return 0;
+}
 
-    pthread_mutex_lock(&timer->mtx);
-    do {
-restart:
-        if (timer->delay_ns <= 0) break;
-        clock_gettime(CLOCK_REALTIME, &now);
-        timeout.tv_sec = now.tv_sec + (timer->delay_ns / NSEC_PER_SEC);
-        timeout.tv_nsec = now.tv_nsec + (timer->delay_ns % NSEC_PER_SEC);
-        if (!timer->armed) {
-            break;
-        }
-        rc = pthread_cond_timedwait(&timer->cv, &timer->mtx, &timeout);
-        if (rc == ETIMEDOUT) {
+RB_HEAD(sgx_lkl_timer_tree, sgx_lkl_timer);
+RB_GENERATE(sgx_lkl_timer_tree, sgx_lkl_timer, node, timer_cmp);
+
+static struct sgx_lkl_timer_tree timers = RB_INITIALIZER(&timers);
+/* protects the timer tree and the armed state of all timers */
+static struct ticketlock timers_lock;
+static int timer_service_started = 0;
+static struct lthread *volatile timer_service_lt = NULL;
+/* timer whose callback is currently executed by the timer service */
+static sgx_lkl_timer *volatile timer_running = NULL;
+
+static void* timer_service(void *unused) {
+    sgx_lkl_timer *timer;
+    unsigned long long now;
+    uint64_t sleep_us;
+
+    timer_service_lt = lthread_self();
+    a_or(&timer_service_lt->attr.state, BIT(LT_ST_KERNEL));
+    lthread_setpriority(timer_service_lt, LTHREAD_PRIO_HIGH);
+    a_barrier();
+
+    for (;;) {
+        now = monotonic_ns();
+
+        ticket_lock(&timers_lock);
+        timer = RB_MIN(sgx_lkl_timer_tree, &timers);
+        if (timer && timer->expiry_ns <= now) {
+            RB_REMOVE(sgx_lkl_timer_tree, &timers, timer);
+            timer->armed = 0;
+            timer_running = timer;
+            ticket_unlock(&timers_lock);
+
+            // The callback may re-arm the timer.
             timer->callback_fn(timer->callback_arg);
-            // If the callback function itself resets the timer,
-            // timer->next_delay_ns will be non-zero.
-            if (timer->armed && timer->next_delay_ns) {
-                timer->delay_ns = timer->next_delay_ns;
-                timer->next_delay_ns = 0;
-                goto restart;
-            }
-        } else {
-            /* Timer was stopped */
-            if (!timer->armed) {
-                break;
-            }
-
-            /* timer_set_oneshot was called while sleeping. */
-            goto restart;
 
+            a_barrier();
+            timer_running = NULL;
+            continue;
         }
-        if (!timer->armed)
-            break;
 
-        rc = pthread_cond_wait(&timer->cv, &timer->mtx);
-    } while (timer->armed);
+        sleep_us = TIMER_SERVICE_MAX_SLEEP_US;
+        if (timer && (timer->expiry_ns - now) / 1000 < sleep_us)
+            sleep_us = (timer->expiry_ns - now + 999) / 1000;
+        ticket_unlock(&timers_lock);
 
-    pthread_mutex_unlock(&timer->mtx);
+        // Returns early if timer_set_oneshot() armed an earlier timer in the
+        // meantime.
+        _lthread_sched_sleep(timer_service_lt, sleep_us);
+    }
 
-    WARN_PTHREAD(pthread_cond_destroy(&timer->cv));
-    WARN_PTHREAD(pthread_mutex_destroy(&timer->mtx));
-    pthread_exit(NULL);
+    return NULL;
+}
+
+static void timer_service_start(void) {
+    pthread_t thread;
+
+    if (a_swap(&timer_service_started, 1))
+        return;
+
+    if (WARN_PTHREAD(pthread_create(&thread, NULL, &timer_service, NULL)))
+        panic();
+    WARN_PTHREAD(pthread_detach(thread));
 }
 
 static void *timer_alloc(void (*fn)(void *), void *arg) {
@@ -328,73 +393,63 @@ static void *timer_alloc(void (*fn)(void *), void *arg) {
     timer->callback_fn = fn;
     timer->callback_arg = arg;
     timer->armed = 0;
-    timer->delay_ns = 0;
-    timer->next_delay_ns = 0;
+    timer->expiry_ns = 0;
+
+    timer_service_start();
+
     return (void*)timer;
 }
 
 static int timer_set_oneshot(void *_timer, unsigned long ns) {
     sgx_lkl_timer *timer = (sgx_lkl_timer*)_timer;
+    unsigned long long expiry_ns = monotonic_ns() + ns;
+    struct lthread *service_lt;
+    int first;
 
     // Overwrite settings if timer was already armed
-    int armed = a_swap(&(timer->armed), 1);
-    if (armed == 1) {
-        if (timer->thread == lthread_self()) {
-            // timer_set_oneshot is executed as part of the current timer's
-            // callback. Do not try to acquire the lock we are already holding.
-            if (timer->next_delay_ns) {
-                fprintf(stderr, "next_delay_ns already set.");
-                panic();
-            }
-            timer->next_delay_ns = ns;
-        } else {
-            timer->delay_ns = ns;
-            WARN_PTHREAD(pthread_mutex_lock(&timer->mtx));
-            WARN_PTHREAD(pthread_cond_signal(&timer->cv));
-            WARN_PTHREAD(pthread_mutex_unlock(&timer->mtx));
-        }
-
-        return 0;
-    }
-
-    int res = 0;
+    ticket_lock(&timers_lock);
+    if (timer->armed)
+        RB_REMOVE(sgx_lkl_timer_tree, &timers, timer);
+    timer->expiry_ns = expiry_ns;
+    RB_INSERT(sgx_lkl_timer_tree, &timers, timer);
     timer->armed = 1;
-    timer->delay_ns = ns;
-    timer->next_delay_ns = 0;
-    pthread_mutex_init(&timer->mtx,NULL);
-    pthread_cond_init(&timer->cv,NULL);
-    res = pthread_create(&(timer->thread), NULL, &timer_callback,
-        (void*)timer);
-
-    if (res != 0) {
-        fprintf(stderr, "Error: pthread_create(timerfn) returned %d\n", res);
-        panic();
-    }
+    first = RB_MIN(sgx_lkl_timer_tree, &timers) == timer;
+    ticket_unlock(&timers_lock);
+
+    // The timer service picks up the new expiry time by itself if it has not
+    // started yet or if it is the one running this (i.e. timer_set_oneshot is
+    // executed as part of a timer callback).
+    service_lt = timer_service_lt;
+    if (first && service_lt && service_lt != lthread_self())
+        lthread_wakeup(service_lt);
 
     return 0;
 }
 
 static void timer_free(void *_timer) {
     sgx_lkl_timer *timer = (sgx_lkl_timer*)_timer;
+    struct lthread *self;
     if (timer == NULL) {
         fprintf(stderr, "WARN: timer_free() called with NULL\n");
         panic();
     }
 
-    int res = 0;
-    if (timer->armed) {
-        WARN_PTHREAD(pthread_mutex_lock(&timer->mtx));
-        timer->armed = 0;
-        WARN_PTHREAD(pthread_cond_signal(&timer->cv));
-        WARN_PTHREAD(pthread_mutex_unlock(&timer->mtx));
-
-        a_barrier();
-        void *exit_val = NULL;
-        res = pthread_join(timer->thread, &exit_val);
-        if (res != 0)
-            lkl_printf("WARN: pthread_join(timer) returned %d\n",
-                res);
+    ticket_lock(&timers_lock);
+    if (timer->armed)
+        RB_REMOVE(sgx_lkl_timer_tree, &timers, timer);
+    timer->armed = 0;
+    ticket_unlock(&timers_lock);
+
+    // Wait for the timer service to finish a running callback of this timer.
+    // Outside of lthread context there is nothing to yield to, so spin.
+    self = lthread_self();
+    while (timer_running == timer && timer_service_lt != self) {
+        if (self)
+            _lthread_sched_sleep(self, 0);
+        else
+            a_spin();
     }
+
     free(_timer);
 }
 
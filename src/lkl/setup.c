@@ -14,8 +14,12 @@
 #include "lkl/disk.h"
 #include "lkl/posix-host.h"
 #include "lkl/setup.h"
+#include "lkl/syscall.h"
 #include "lkl/virtio_net.h"
 #include "enclave_config.h"
+#include "enclave_mem.h"
+#include "enclave_string.h"
+#include "lthread.h"
 #include "sgxlkl_debug.h"
 #include "sgxlkl_util.h"
 
@@ -569,6 +573,8 @@ void __lkl_start_init(enclave_config_t* encl)
 {
 	size_t i;
 
+	enclave_string_init(encl->cpu_features);
+
 	// Overwrite function pointers from LKL's posix-host.c with ours
 	lkl_host_ops = sgxlkl_host_ops;
 	lkl_dev_blk_ops = sgxlkl_dev_plaintext_blk_ops;
@@ -601,6 +607,8 @@ void __lkl_start_init(enclave_config_t* encl)
 	if (getenv_bool("SGXLKL_MMAP_FILE_SUPPORT", 0))
 		sgxlkl_mmap_file_support = 1;
 
+	lthread_sched_ethreads_init(encl);
+
 	num_disks = encl->num_disks;
 	if (num_disks <= 0) {
 		fprintf(stderr, "Error: No root disk provided. Aborting...\n");
@@ -624,6 +632,19 @@ void __lkl_start_init(enclave_config_t* encl)
 	const char *lkl_cmdline = getenv("SGXLKL_CMDLINE");
 	if (lkl_cmdline == NULL)
 		lkl_cmdline = DEFAULT_LKL_CMDLINE;
+	// The kernel memory size is fixed at build time unless overridden by
+	// mem=, which must come first so that SGXLKL_CMDLINE can still override it.
+	char *lkl_cmdline_mem = NULL;
+	if (encl->kernel_mem) {
+		size_t len = strlen(lkl_cmdline) + 32;
+		lkl_cmdline_mem = malloc(len);
+		if (lkl_cmdline_mem == NULL) {
+			fprintf(stderr, "Error: Could not allocate kernel command line\n");
+			exit(EXIT_FAILURE);
+		}
+		snprintf(lkl_cmdline_mem, len, "mem=%zu %s", encl->kernel_mem, lkl_cmdline);
+		lkl_cmdline = lkl_cmdline_mem;
+	}
 	SGXLKL_VERBOSE("With command line: %s\n", lkl_cmdline);
 	SGXLKL_VERBOSE("Using host networking stack: %s\n", (sgxlkl_use_host_network ? "YES" : "no"));
 	SGXLKL_VERBOSE("Using LKL mmap file support: %s\n", (sgxlkl_mmap_file_support ? "YES" : "no"));
@@ -633,6 +654,7 @@ void __lkl_start_init(enclave_config_t* encl)
 	}
 
 	long res = lkl_start_kernel(&lkl_host_ops, lkl_cmdline);
+	free(lkl_cmdline_mem);
 	if (res < 0) {
 		fprintf(stderr, "Error: could not start LKL kernel, %s\n",
 			lkl_strerror(res));
@@ -694,6 +716,38 @@ int timespec_diff(struct timespec *starttime, struct timespec *endtime, struct t
 	return 0;
 }
 
+/*
+ * SGX-LKL runs a single process, so its pid never changes. It is looked up in
+ * LKL on the first call only.
+ */
+static volatile pid_t lkl_pid = 0;
+
+pid_t syscall_SYS_getpid(void) {
+	long params[6] = {0};
+	pid_t pid = lkl_pid;
+	if (pid == 0 && (pid = lkl_syscall_lkl(__lkl__NR_getpid, params)) > 0)
+		lkl_pid = pid;
+	return pid;
+}
+
+static void print_mem_stats(void)
+{
+	struct enclave_mem_stats st;
+	enclave_mem_get_stats(&st);
+
+	printf("Enclave memory: %zu KB used of %zu KB (max. %zu KB)\n",
+		st.used_pages * PAGE_SIZE / 1024, st.total_pages * PAGE_SIZE / 1024,
+		st.max_used_pages * PAGE_SIZE / 1024);
+	printf("Free ranges: %zu, largest: %zu KB\n", st.free_extents,
+		st.largest_free_extent * PAGE_SIZE / 1024);
+	printf("mmap: %" PRIu64 " (%" PRIu64 " failed), munmap: %" PRIu64 "\n",
+		st.mmaps, st.mmap_failures, st.munmaps);
+	printf("mremap: %" PRIu64 " in place, %" PRIu64 " copied (%" PRIu64 " KB)\n",
+		st.mremaps_in_place, st.mremaps_copied, st.mremap_copied_bytes / 1024);
+	printf("Zeroed pages: %" PRIu64 " on demand, %" PRIu64 " by idle ethreads\n",
+		st.zeroed_pages, st.zeroed_idle_pages);
+}
+
 void __lkl_exit()
 {
 	if (getenv("SGXLKL_PRINT_APP_RUNTIME")) {
@@ -703,6 +757,9 @@ void __lkl_exit()
 		printf("Application runtime: %lld.%.9lds\n", runtime.tv_sec, runtime.tv_nsec);
 	}
 
+	if (getenv_bool("SGXLKL_PRINT_MEM_STATS", 0))
+		print_mem_stats();
+
 	long res;
 	for (int i = num_disks - 1; i >= 0; --i) {
 		res = lkl_umount_timeout(disks[i].mnt, 0, UMOUNT_DISK_TIMEOUT);
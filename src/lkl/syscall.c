@@ -0,0 +1,72 @@
+/*
+ * Copyright 2016, 2017, 2018 Imperial College London
+ */
+
+/*
+ * sgx-lkl-musl passes the system calls it does not handle itself to LKL via
+ * lkl_syscall(). System calls that only depend on lthread or enclave memory
+ * state are served within the enclave here instead, which avoids the LKL CPU
+ * lock that serialises all LKL system calls. Everything else is passed on to
+ * LKL's lkl_syscall(), which the Makefile renames to lkl_syscall_lkl() in
+ * liblkl.a.
+ */
+
+#include <time.h>
+#include <lkl_host.h>
+#include "enclave_mem.h"
+#include "hostcalls.h"
+#include "lkl/syscall.h"
+
+long lkl_syscall(long no, long *params) {
+    switch (no) {
+        case __lkl__NR_sched_setparam:
+            return syscall_SYS_sched_setparam((pid_t) params[0], (const struct sched_param *) params[1]);
+        case __lkl__NR_sched_setscheduler:
+            return syscall_SYS_sched_setscheduler((pid_t) params[0], (int) params[1], (const struct sched_param *) params[2]);
+        case __lkl__NR_sched_getscheduler:
+            return syscall_SYS_sched_getscheduler((pid_t) params[0]);
+        case __lkl__NR_sched_getparam:
+            return syscall_SYS_sched_getparam((pid_t) params[0], (struct sched_param *) params[1]);
+        case __lkl__NR_sched_setaffinity:
+            return syscall_SYS_sched_setaffinity((pid_t) params[0], (size_t) params[1], (const cpu_set_t *) params[2]);
+        case __lkl__NR_sched_getaffinity:
+            return syscall_SYS_sched_getaffinity((pid_t) params[0], (size_t) params[1], (cpu_set_t *) params[2]);
+        case __lkl__NR_sched_yield:
+            return syscall_SYS_sched_yield();
+        case __lkl__NR_sched_get_priority_max:
+            return syscall_SYS_sched_get_priority_max((int) params[0]);
+        case __lkl__NR_sched_get_priority_min:
+            return syscall_SYS_sched_get_priority_min((int) params[0]);
+        case __lkl__NR_sched_rr_get_interval:
+            return syscall_SYS_sched_rr_get_interval((pid_t) params[0], (struct timespec *) params[1]);
+        case __lkl__NR_getcpu:
+            return syscall_SYS_getcpu((unsigned *) params[0], (unsigned *) params[1], (void *) params[2]);
+        case __lkl__NR_getpid:
+            return syscall_SYS_getpid();
+        case __lkl__NR_gettid:
+            return syscall_SYS_gettid();
+        case __lkl__NR_clock_nanosleep:
+            return syscall_SYS_clock_nanosleep((clockid_t) params[0], (int) params[1],
+                                               (const struct timespec *) params[2], (struct timespec *) params[3]);
+#ifdef __lkl__NR_madvise
+        case __lkl__NR_madvise:
+            return syscall_SYS_madvise((void *) params[0], (size_t) params[1], (int) params[2]);
+#endif
+#ifdef __lkl__NR_membarrier
+        case __lkl__NR_membarrier:
+            return syscall_SYS_membarrier((int) params[0], (int) params[1]);
+#endif
+        case __lkl__NR_read:
+        case __lkl__NR_write:
+        case __lkl__NR_readv:
+        case __lkl__NR_writev:
+        case __lkl__NR_pread64:
+        case __lkl__NR_pwrite64:
+        case __lkl__NR_preadv:
+        case __lkl__NR_pwritev:
+            // Keeps shared file mappings coherent, see src/sgx/enclave_mem.c.
+            return enclave_mmap_file_io(no, params);
+        default:
+            return lkl_syscall_lkl(no, params);
+    }
+}
@@ -20,6 +20,7 @@
 #include <elf.h>
 #include <signal.h>
 #include <assert.h>
+#include <cpuid.h>
 #include <sys/auxv.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -29,6 +30,7 @@
 #include <sys/types.h>
 #include <arpa/inet.h>
 #include <netinet/ip.h>
+#include <linux/futex.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
 
@@ -154,6 +156,9 @@ static void usage(char* prog) {
     printf("SGXLKL_ESLEEP: Sleep timeout in the scheduler (in ns).\n");
     printf("SGXLKL_ESPINS: Number of spins inside scheduler before sleeping begins.\n");
     printf("SGXLKL_ETHREADS: Number of enclave threads.\n");
+    printf("SGXLKL_KERNEL_ETHREADS: Number of enclave threads reserved for LKL kernel threads (e.g. timers, network and disk processing). Must be smaller than SGXLKL_ETHREADS (Default: 0).\n");
+    printf("SGXLKL_ETHREADS_PARK: Set to 1 to park idle enclave threads until there is work for them (Default: 0).\n");
+    printf("SGXLKL_TIMESLICE: Timeslice of lthreads (in us). lthreads running longer without yielding are reported and yield at the next yield point (see lthread_yield_point). 0 disables run-time accounting (Default: 0).\n");
     printf("SGXLKL_STHREADS: Number of system call threads outside the enclave.\n");
     printf("SGXLKL_MAX_USER_THREADS: Max. number of user-level thread inside the enclave.\n");
     printf("SGXLKL_REAL_TIME_PRIO: Set to 1 to use realtime priority for enclave threads.\n");
@@ -177,8 +182,11 @@ static void usage(char* prog) {
     printf("SGXLKL_HDS: Secondary file system images. Comma-separated list of the format: disk1path:disk1mntpoint:disk1mode,disk2path:disk2mntpoint:disk2mode,[...].\n");
     printf("\n## Memory ##\n");
     printf("SGXLKL_HEAP: Total heap size (in bytes) available in the enclave. This includes memory used by the kernel.\n");
+    printf("SGXLKL_KERNEL_MEM: Memory available to the LKL kernel, e.g. for the page cache and socket buffers. It is allocated from SGXLKL_HEAP. 0 uses the default set at build time by BOOT_MEM (Default: 0).\n");
+    printf("SGXLKL_HEAP_HUGEPAGES: Backing of the heap in simulation mode. 0: regular pages, 1: transparent huge pages, 2: explicit huge pages (hugetlbfs, must be reserved on the host; mprotect and madvise calls that are not aligned to huge pages will fail) (Default: 0).\n");
+    printf("SGXLKL_HEAP_PREFAULT: Number of threads used to fault in the heap at startup in simulation mode. 0 disables pre-faulting (Default: 0).\n");
     printf("SGXLKL_STACK_SIZE: Stack size of in-enclave user-level threads.\n");
-    printf("SGXLKL_MMAP_FILE_SUPPORT: <Not yet supported>\n");
+    printf("SGXLKL_MMAP_FILE_SUPPORT: Set to 1 to support mmap of files on enclave file systems. Mapped files are copied into enclave memory, shared mappings are kept coherent with read and write, and writes through shared mappings reach the file on msync and munmap (Default: 0).\n");
     printf("SGXLKL_SHMEM_FILE: Name of the file to be used for shared memory between the enclave and the outside.\n");
     printf("SGXLKL_SHMEM_SIZE: Size of the file to be used for shared memory between the enclave and the outside.\n");
     printf("\n## Debugging ##\n");
@@ -190,6 +198,7 @@ static void usage(char* prog) {
     printf("SGXLKL_TRACE_INTERNAL_SYSCALL: Print detailed information about in-enclave system calls not handled by LKL (in particular mmap/mremap/munmap and futex).\n");
     printf("SGXLKL_TRACE_HOST_SYSCALL: Print detailed information about host system calls.\n");
     printf("SGXLKL_PRINT_HOST_SYSCALL_STATS: Print statistics on the number of host system calls and enclave exits.\n");
+    printf("SGXLKL_PRINT_MEM_STATS: Print enclave memory usage, fragmentation and mmap statistics when the application exits.\n");
     printf("SGXLKL_PRINT_APP_RUNTIME: Measure and print total runtime of the application itself excluding the enclave and SGX-LKL startup and shutdown time.\n");
     printf("\n%s --version to print version information.\n", prog);
     printf("%s --help to print this help.\n", prog);
@@ -236,6 +245,13 @@ static inline void do_syscall(syscall_t *sc) {
     sc->ret_val = ret;
 }
 
+/* Wakes up as many parked enclave threads as the enclave asked for */
+static inline void unpark_ethread(enclave_config_t *conf) {
+    int n;
+    if (conf->ethreads_unpark && (n = __sync_lock_test_and_set(&conf->ethreads_unpark, 0)))
+        syscall(SYS_futex, &conf->ethreads_park_word, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
 void *host_syscall_thread(void *v) {
     enclave_config_t *conf = v;
     volatile syscall_t *scall = conf->syscallpage;
@@ -245,7 +261,8 @@ void *host_syscall_thread(void *v) {
     union {void *ptr; size_t i;} u;
     u.ptr = MAP_FAILED;
     while (1) {
-        for (s = 0; !mpmc_dequeue(&conf->syscallq, &u.ptr);) {s = backoff(s);}
+        unpark_ethread(conf);
+        for (s = 0; !mpmc_dequeue(&conf->syscallq, &u.ptr);) {unpark_ethread(conf); s = backoff(s);}
         i = u.i;
 
 #ifdef DEBUG
@@ -417,6 +434,63 @@ static void *register_shm(char* path, size_t len) {
     return addr;
 }
 
+#ifndef SGXLKL_HW
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* Backing of the enclave heap in simulation mode, see SGXLKL_HEAP_HUGEPAGES */
+#define HEAP_HUGEPAGES_NONE        0
+#define HEAP_HUGEPAGES_TRANSPARENT 1
+#define HEAP_HUGEPAGES_EXPLICIT    2
+
+struct prefault_args {
+    pthread_t thread;
+    int created;
+    volatile char *start;
+    size_t len;
+};
+
+static void *prefault_thread(void *arg) {
+    struct prefault_args *a = arg;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+
+    // The heap is still zero, writing zeroes faults pages in without changing it.
+    for (size_t off = 0; off < a->len; off += page_size)
+        a->start[off] = 0;
+
+    return NULL;
+}
+
+/*
+ * Faults in the enclave heap using nthreads threads so that the enclave does
+ * not take a host page fault on the first access to each page.
+ */
+static void prefault_heap(char *heap, size_t size, size_t nthreads) {
+    struct prefault_args *args = calloc(nthreads, sizeof(*args));
+    size_t chunk, i;
+
+    if (!args) {
+        fprintf(stderr, "[    SGX-LKL   ] Warning: Could not allocate memory to pre-fault heap.\n");
+        return;
+    }
+
+    // Chunks are aligned to huge pages so that threads do not fault in the same huge page.
+    chunk = ((size + nthreads - 1) / nthreads + HUGE_PAGE_SIZE - 1) & ~(size_t) (HUGE_PAGE_SIZE - 1);
+    for (i = 0; i < nthreads && i * chunk < size; i++) {
+        args[i].start = heap + i * chunk;
+        args[i].len = size - i * chunk < chunk ? size - i * chunk : chunk;
+        args[i].created = !pthread_create(&args[i].thread, NULL, prefault_thread, &args[i]);
+        if (!args[i].created)
+            prefault_thread(&args[i]);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        if (args[i].created)
+            pthread_join(args[i].thread, NULL);
+    }
+    free(args);
+}
+#endif /* !SGXLKL_HW */
+
 static void register_net(enclave_config_t* encl, const char* tapstr, const char* ip4str,
         const char* mask4str, const char* gw4str, const char* hostname) {
     // Set hostname
@@ -511,6 +585,23 @@ static void register_net(enclave_config_t* encl, const char* tapstr, const char*
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 
+/* CPUID.(EAX=7, ECX=0):EBX */
+#define CPUID_7_EBX_ERMS (1 << 9)
+
+/* Detects CPU features used by the enclave, which cannot execute CPUID itself. */
+static uint32_t get_cpu_features(void) {
+    unsigned int eax, ebx, ecx, edx;
+    uint32_t features = 0;
+
+    if (__get_cpuid_max(0, NULL) >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        if (ebx & CPUID_7_EBX_ERMS)
+            features |= SGXLKL_CPU_ERMS;
+    }
+
+    return features;
+}
+
 void set_sysconf_params(enclave_config_t *conf) {
     long no_ethreads = (long) getenv_uint64("SGXLKL_ETHREADS", 1, 1024);
     conf->sysconf_nproc_conf = MIN(sysconf(_SC_NPROCESSORS_CONF), no_ethreads);
@@ -610,6 +701,13 @@ void* enclave_thread(void* parm) {
                 args->call_id = SGXLKL_ENTER_SYSCALL_RESUME;
                 break;
             }
+            case SGXLKL_EXIT_PARK: {
+                enclave_config_t *encl = args->args;
+                struct timespec timeout = {0, SGXLKL_ETHREAD_PARK_TIMEOUT_NS};
+                syscall(SYS_futex, &encl->ethreads_park_word, FUTEX_WAIT, (int)ret[1], &timeout, NULL, 0);
+                args->call_id = SGXLKL_ENTER_SYSCALL_RESUME;
+                break;
+            }
             case SGXLKL_EXIT_ERROR: {
                 fprintf(stderr, "error inside enclave, error code: %lu \n", ret[1]);
                 exit(EXIT_FAILURE);
@@ -872,6 +970,9 @@ int main(int argc, char *argv[], char *envp[]) {
 #ifndef SGXLKL_HW
     /* initialize heap and system call pages */
     encl.heapsize = getenv_uint64("SGXLKL_HEAP", DEFAULT_HEAP_SIZE, ULONG_MAX);
+    int heap_hugepages = getenv_uint64("SGXLKL_HEAP_HUGEPAGES", HEAP_HUGEPAGES_NONE, HEAP_HUGEPAGES_EXPLICIT);
+    if (heap_hugepages == HEAP_HUGEPAGES_EXPLICIT)
+        encl.heapsize = (encl.heapsize + HUGE_PAGE_SIZE - 1) & ~(size_t) (HUGE_PAGE_SIZE - 1);
     encl_mmap_flags = mmapflags;
     if (getenv_bool("SGXLKL_NON_PIE", 0)) {
         if ((char*) SIM_NON_PIE_ENCL_MMAP_OFFSET + encl.heapsize > &__sgxlklrun_text_segment_start) {
@@ -880,10 +981,24 @@ int main(int argc, char *argv[], char *envp[]) {
         }
         encl_mmap_flags |= MAP_FIXED;
     }
-    encl.heap = mmap((void*) SIM_NON_PIE_ENCL_MMAP_OFFSET, encl.heapsize, PROT_EXEC|PROT_READ|PROT_WRITE, encl_mmap_flags, -1, 0);
+    encl.heap = MAP_FAILED;
+    if (heap_hugepages == HEAP_HUGEPAGES_EXPLICIT) {
+        encl.heap = mmap((void*) SIM_NON_PIE_ENCL_MMAP_OFFSET, encl.heapsize, PROT_EXEC|PROT_READ|PROT_WRITE, encl_mmap_flags|MAP_HUGETLB, -1, 0);
+        if (encl.heap == MAP_FAILED) {
+            fprintf(stderr, "[    SGX-LKL   ] Warning: Could not map heap with explicit huge pages (%s). Using transparent huge pages instead.\n", strerror(errno));
+            heap_hugepages = HEAP_HUGEPAGES_TRANSPARENT;
+        }
+    }
+    if (encl.heap == MAP_FAILED)
+        encl.heap = mmap((void*) SIM_NON_PIE_ENCL_MMAP_OFFSET, encl.heapsize, PROT_EXEC|PROT_READ|PROT_WRITE, encl_mmap_flags, -1, 0);
     if (encl.heap == MAP_FAILED) {
         return -1;
     }
+    if (heap_hugepages == HEAP_HUGEPAGES_TRANSPARENT && madvise(encl.heap, encl.heapsize, MADV_HUGEPAGE))
+        fprintf(stderr, "[    SGX-LKL   ] Warning: Could not enable transparent huge pages for heap (%s).\n", strerror(errno));
+    size_t heap_prefault = getenv_uint64("SGXLKL_HEAP_PREFAULT", 0, 1024);
+    if (heap_prefault)
+        prefault_heap(encl.heap, encl.heapsize, heap_prefault);
 #else
     /* Map enclave file into memory */
     int lkl_lib_fd;
@@ -908,6 +1023,7 @@ int main(int argc, char *argv[], char *envp[]) {
     create_enclave_mem(enclave_start, 0, getenv_bool("SGXLKL_NON_PIE", 0), &__sgxlklrun_text_segment_start);
 #endif
     encl.maxsyscalls = getenv_uint64("SGXLKL_MAX_USER_THREADS", 256, 100000);
+    encl.kernel_mem = getenv_uint64("SGXLKL_KERNEL_MEM", 0, ULONG_MAX);
 
     rqs = sizeof(encl.returnq.buffer)*256;
     sqs = sizeof(encl.syscallq.buffer)*256;
@@ -957,6 +1073,15 @@ int main(int argc, char *argv[], char *envp[]) {
     ntsyscall = getenv_uint64("SGXLKL_STHREADS", 4, 1024);
     long nproc = sysconf(_SC_NPROCESSORS_ONLN);
     ntenclave = getenv_uint64("SGXLKL_ETHREADS", 1, 1024);
+    encl.ethreads = ntenclave;
+    encl.ethreads_park = getenv_bool("SGXLKL_ETHREADS_PARK", 0);
+    encl.kernel_ethreads = getenv_uint64("SGXLKL_KERNEL_ETHREADS", 0, 1024);
+    if (encl.kernel_ethreads && encl.kernel_ethreads >= ntenclave) {
+        fprintf(stderr, "[    SGX-LKL   ] Error: SGXLKL_KERNEL_ETHREADS must be smaller than SGXLKL_ETHREADS.\n");
+        return -1;
+    }
+    encl.timeslice = getenv_uint64("SGXLKL_TIMESLICE", 0, ULONG_MAX);
+    encl.cpu_features = get_cpu_features();
     ts = calloc(sizeof(*ts), ntenclave + ntsyscall);
     if (ts == 0) {
         return -1;
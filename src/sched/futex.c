@@ -2,6 +2,8 @@
  * Copyright 2016, 2017, 2018 Imperial College London
  */
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <time.h>
 #include <lthread.h>
@@ -10,6 +12,7 @@
 #include <sgxlkl_debug.h>
 
 #include <futex.h>
+#include "pthread_impl.h"
 
 /* stores all the futex_q's */
 SLIST_HEAD(__futex_q_head, futex_q) futex_queues =
@@ -25,6 +28,19 @@ static volatile int futex_sleepers;
 #define FUTEX_NONE    0 /* no extraordinary happened */
 #define FUTEX_EXPIRED 1 /* timeout expired */
 
+/*
+ * Adaptive spinning before FUTEX_WAIT. Locks are often released by an lthread
+ * running on another ethread shortly after a waiter finds them contended.
+ * Spinning avoids taking futex_q_lock, queuing and a full yield/wake cycle in
+ * that case. We only spin on the lock word of a musl mutex that tracks its
+ * owner (recursive, errorcheck and robust mutexes) while the owner is running.
+ * When contended, such a word holds the owner tid and the waiters bit. Other
+ * futex words (normal mutexes, condition variables, ...) hold small integers
+ * that cannot be told apart from tids, waiters on them do not spin.
+ */
+#define FUTEX_SPINS_OWNER   2000
+#define FUTEX_SPIN_RECHECK  64
+
 //#define SGXLKL_DEBUG_FUTEX
 #ifdef SGXLKL_DEBUG_FUTEX
 # define FUTEX_SGXLKL_VERBOSE(...) SGXLKL_VERBOSE(__VA_ARGS__)
@@ -79,6 +95,44 @@ futex_tick() {
     ticket_unlock(&futex_q_lock);
 }
 
+/*
+ * Returns the owner tid if uaddr is the lock word of a contended owner-tracking
+ * mutex, 0 otherwise. The mutex type precedes the lock word, we don't look at
+ * it if it would be on another page than uaddr.
+ */
+static int
+futex_owner(int *uaddr, int val) {
+    const size_t off = offsetof(pthread_mutex_t, _m_lock);
+    pthread_mutex_t *m;
+
+    if (!(val & 0x80000000) || (uintptr_t)uaddr % PAGE_SIZE < off)
+        return 0;
+    m = (pthread_mutex_t *)((char *)uaddr - off);
+    if ((m->_m_type & 15) == PTHREAD_MUTEX_NORMAL)
+        return 0;
+    return val & 0x3fffffff;
+}
+
+/* returns 1 if *uaddr changed while spinning */
+static int
+futex_spin(int *uaddr, int val) {
+    int i, owner = futex_owner(uaddr, val);
+
+    if (!owner || !lthread_sched_owner_running(owner))
+        return 0;
+
+    for (i = 1; i <= FUTEX_SPINS_OWNER; i++) {
+        a_spin();
+        /* a plain load does not take the cache line away from the owner */
+        if (*(volatile int *)uaddr != val)
+            return 1;
+        /* stop once the owner has been descheduled */
+        if (i % FUTEX_SPIN_RECHECK == 0 && !lthread_sched_owner_running(owner))
+            return 0;
+    }
+    return 0;
+}
+
 /* constructs a new futex_q */
 static struct futex_q *
 __futex_wait_new(uint32_t futex_key, uint32_t bitset) {
@@ -272,6 +326,9 @@ syscall_SYS_futex(int *uaddr, int op, int val, const struct timespec *timeout,
         clock_gettime(clock, &now);
     }
 
+    if ((op == FUTEX_WAIT || op == FUTEX_WAIT_BITSET) && futex_spin(uaddr, val))
+        return -EAGAIN;
+
     ticket_lock(&futex_q_lock);
     switch(op) {
         case FUTEX_WAIT_BITSET:
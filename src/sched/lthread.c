@@ -28,6 +28,7 @@
  */
 
 #define WANT_REAL_ARCH_SYSCALLS
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,13 +37,16 @@
 #include <stdarg.h>
 #include <limits.h>
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <fcntl.h>
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <stddef.h>
+#include <time.h>
 
 #include <lthread.h>
 #include "libc.h"
@@ -51,6 +55,9 @@
 #include "sgxlkl_debug.h"
 #include "stdio_impl.h"
 #include "hostcall_interface.h"
+#include "enclave_mem.h"
+#include <futex.h>
+#include "hostcalls.h"
 #include "ticketlock.h"
 #include "tree.h"
 
@@ -60,7 +67,7 @@ int __copy_utls(uint8_t **, size_t *);
 static void _exec(void *lt);
 static inline void _lthread_madvise(struct lthread *lt);
 static void _lthread_init(struct lthread *lt);
-static void _lthread_resume_expired(struct timespec *ts);
+static void _lthread_resume_expired(void);
 static void _lthread_lock(struct lthread *lt);
 static void lthread_rundestructors(struct lthread *lt);
 
@@ -91,6 +98,10 @@ static size_t nsleepers = 0;
 static size_t sleepspins = 500000000;
 static size_t sleeptime_ns = 1600;
 static size_t futex_wake_spins = 500;
+
+/* lthread timeslice for run-time accounting, 0 if disabled */
+static uint64_t timeslice_usecs = 0;
+#define LTHREAD_YIELD_POINT_OPS 1024
 static volatile int schedqueuelen = 0;
 
 #if DEBUG
@@ -170,21 +181,546 @@ static void _exec(void *lt_) {
     _lthread_yield(lt);
 }
 
-static long lthread_scall(long n, long a1, long a2, long a3) {
+static long lthread_scall(long n, long a1, long a2, long a3, long a4) {
     unsigned long ret;
-    register long r10 __asm__("r10") = a3;
+    register long r10 __asm__("r10") = a4;
     register long r8 __asm__("r8") = 0;
     register long r9 __asm__("r9") = 0;
-    __asm__ __volatile__ ("syscall" : "=a"(ret) : "a"(n), "D"(a1), "S"(a2), "d"(0), "r"(r10), "r"(r8), "r"(r9)
+    __asm__ __volatile__ ("syscall" : "=a"(ret) : "a"(n), "D"(a1), "S"(a2), "d"(a3), "r"(r10), "r"(r8), "r"(r9)
                           : "rcx", "r11", "memory");
     return ret;
 }
 
+/*
+ * Parking of idle ethreads. An ethread that has not found any work for
+ * LTHREAD_PARK_SPINS iterations of its scheduler loop parks itself on a futex
+ * word in host memory, unless it is the last active ethread (which keeps
+ * servicing timeouts and sleepers). __scheduler_enqueue wakes up a parked
+ * ethread when the scheduler queue holds more lthreads than there are active
+ * ethreads. The number of active ethreads therefore follows the load.
+ *
+ * In simulation mode, ethreads wait on and wake up the futex directly. In
+ * hardware mode, a parked ethread leaves the enclave to wait and wakeups are
+ * requested from the host syscall threads. Parked ethreads also wake up after
+ * SGXLKL_ETHREAD_PARK_TIMEOUT_NS to recheck the queue.
+ *
+ * Optionally, the first kernel_ethreads ethreads are reserved for LKL kernel
+ * lthreads (LT_ST_KERNEL). They only run lthreads from
+ * __scheduler_queue_kernel and never park, all other ethreads only run
+ * application lthreads.
+ */
+#define LTHREAD_PARK_SPINS 100000
+#define LTHREAD_KERNEL_QUEUE_SIZE 1024
+
+volatile int __parked_ethreads = 0;
+static volatile int active_ethreads = 0;
+static int park_enabled = 0;
+static volatile int *park_word;
+static volatile int *unpark_request;
+
+static void _lthread_ethread_queues_init(size_t ethreads);
+
+int __kernel_ethreads = 0;
+static int ethreads_started = 0;
+/* scheduler of each ethread, indexed by ethread_id */
+#define LTHREAD_MAX_ETHREADS 1024
+static struct lthread_sched *ethread_scheds[LTHREAD_MAX_ETHREADS];
+struct mpmcq __scheduler_queue_kernel;
+static struct cell_t kernel_queue_buffer[LTHREAD_KERNEL_QUEUE_SIZE];
+
+void lthread_sched_ethreads_init(enclave_config_t *encl) {
+    size_t app_ethreads = encl->ethreads;
+
+    park_word = &encl->ethreads_park_word;
+    unpark_request = &encl->ethreads_unpark;
+    if (encl->kernel_ethreads && encl->kernel_ethreads < encl->ethreads) {
+        newmpmcq(&__scheduler_queue_kernel, sizeof(kernel_queue_buffer), kernel_queue_buffer);
+        app_ethreads -= encl->kernel_ethreads;
+        a_barrier();
+        __kernel_ethreads = encl->kernel_ethreads;
+    }
+    active_ethreads = app_ethreads;
+    timeslice_usecs = encl->timeslice;
+    _lthread_ethread_queues_init(encl->ethreads);
+    a_barrier();
+    park_enabled = encl->ethreads_park && app_ethreads > 1;
+}
+
+static inline int _lthread_is_kernel(struct lthread *lt) {
+    return (lt->attr.state & BIT(LT_ST_KERNEL)) != 0;
+}
+
+/*
+ * Lthreads can be bound to an ethread (lthread_setaffinity). They are then
+ * only queued on the per-ethread queue of that ethread, which the ethread
+ * checks before the shared queues. Ethreads with bound lthreads do not park.
+ */
+#define LTHREAD_ETHREAD_QUEUE_SIZE 256
+
+struct mpmcq *__ethread_queues = NULL;
+static volatile int *ethread_bound;
+static volatile int *ethread_parked;
+static int num_ethreads = 0;
+
+static void _lthread_ethread_queues_init(size_t ethreads) {
+    struct mpmcq *queues;
+    size_t i;
+
+    if (ethreads < 2)
+        return;
+    ethread_bound = calloc(ethreads, sizeof(*ethread_bound));
+    ethread_parked = calloc(ethreads, sizeof(*ethread_parked));
+    queues = calloc(ethreads, sizeof(*queues));
+    if (!ethread_bound || !ethread_parked || !queues)
+        return;
+    for (i = 0; i < ethreads; i++)
+        newmpmcq(&queues[i], LTHREAD_ETHREAD_QUEUE_SIZE * sizeof(struct cell_t), NULL);
+    num_ethreads = ethreads;
+    a_barrier();
+    __ethread_queues = queues;
+}
+
+/*
+ * Binds lt to the given ethread, or unbinds it if ethread is -1. A bound
+ * lthread migrates to its ethread the next time it is scheduled.
+ */
+int lthread_setaffinity(struct lthread *lt, int ethread) {
+    int old;
+
+    if (ethread < -1 || ethread >= num_ethreads)
+        return EINVAL;
+    if (!__ethread_queues)
+        return 0;
+
+    old = a_swap(&lt->affinity, ethread + 1);
+    if (old)
+        a_dec(&ethread_bound[old - 1]);
+    if (ethread >= 0)
+        a_inc(&ethread_bound[ethread]);
+    return 0;
+}
+
+/*
+ * CPUs are mapped onto ethreads round-robin (CPU c runs on ethread c mod
+ * number of ethreads). Masks that allow all ethreads unbind the lthread, other
+ * masks bind it to one of the allowed ethreads, preferably the current one.
+ * Only the calling thread is supported.
+ */
+int syscall_SYS_sched_setaffinity(pid_t pid, size_t cpusetsize, const cpu_set_t *mask) {
+    struct lthread *lt = lthread_self();
+    int e, self, target = -1, allowed = 0;
+    size_t cpu;
+
+    if (lt == NULL || (pid != 0 && pid != lt->tid))
+        return -ESRCH;
+    if (mask == NULL)
+        return -EFAULT;
+    if (num_ethreads == 0)
+        return 0;
+
+    self = lthread_get_sched()->ethread_id;
+    for (e = 0; e < num_ethreads; e++) {
+        for (cpu = e; cpu < cpusetsize * 8; cpu += num_ethreads) {
+            if (CPU_ISSET_S(cpu, cpusetsize, mask))
+                break;
+        }
+        if (cpu >= cpusetsize * 8)
+            continue;
+        allowed++;
+        if (target < 0 || e == self)
+            target = e;
+    }
+    if (target < 0)
+        return -EINVAL;
+
+    /* all ethreads allowed, no need to bind */
+    if (allowed == num_ethreads)
+        target = -1;
+
+    lthread_setaffinity(lt, target);
+    if (target >= 0 && target != self)
+        _lthread_sched_sleep(lt, 0);
+    return 0;
+}
+
+int syscall_SYS_sched_getaffinity(pid_t pid, size_t cpusetsize, cpu_set_t *mask) {
+    struct lthread *lt = lthread_self();
+    size_t cpu, ncpus;
+
+    if (lt == NULL || (pid != 0 && pid != lt->tid))
+        return -ESRCH;
+    if (mask == NULL)
+        return -EFAULT;
+
+    ncpus = num_ethreads ? num_ethreads : 1;
+    if (cpusetsize * 8 < ncpus)
+        return -EINVAL;
+
+    CPU_ZERO_S(cpusetsize, mask);
+    for (cpu = 0; cpu < ncpus; cpu++) {
+        if (!lt->affinity || lt->affinity - 1 == cpu)
+            CPU_SET_S(cpu, cpusetsize, mask);
+    }
+    return cpusetsize;
+}
+
+/*
+ * Used for adaptive spinning on contended futexes. Returns 1 if the lthread
+ * with the given tid is running on another ethread, 0 otherwise.
+ */
+int lthread_sched_owner_running(int tid) {
+    struct lthread_sched *s, *self = lthread_get_sched();
+    int i, n = ethreads_started;
+
+    if (n > LTHREAD_MAX_ETHREADS)
+        n = LTHREAD_MAX_ETHREADS;
+    for (i = 0; i < n; i++) {
+        s = ethread_scheds[i];
+        if (s != NULL && s != self && s->current_tid == tid)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * membarrier(2) within the enclave. All lthreads run on ethreads, and each
+ * ethread publishes the lthread it runs in current_tid with a sequentially
+ * consistent store before switching to it. After a full fence on the calling
+ * ethread, it is therefore sufficient to wait until every other ethread is
+ * either not running an lthread or has switched out the lthread it was
+ * running. The caller yields while waiting. An lthread that does not yield
+ * would delay us indefinitely, so after LTHREAD_MEMBARRIER_MAX_WAITS we issue
+ * a membarrier on the host instead, which interrupts (and so serializes) all
+ * ethreads. Since all lthreads belong to the same process, global and private
+ * barriers are the same.
+ */
+#ifndef MEMBARRIER_CMD_QUERY
+#define MEMBARRIER_CMD_QUERY                        0
+#define MEMBARRIER_CMD_GLOBAL                       (1 << 0)
+#define MEMBARRIER_CMD_GLOBAL_EXPEDITED             (1 << 1)
+#define MEMBARRIER_CMD_REGISTER_GLOBAL_EXPEDITED    (1 << 2)
+#define MEMBARRIER_CMD_PRIVATE_EXPEDITED            (1 << 3)
+#define MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED   (1 << 4)
+#endif
+
+#define LTHREAD_MEMBARRIER_MAX_WAITS 128
+
+static void _lthread_membarrier(void) {
+    struct lthread_sched *s, *self = lthread_get_sched();
+    struct lthread *lt = lthread_self();
+    uint64_t passes;
+    int i, waits = 0, n = ethreads_started;
+
+    if (n > LTHREAD_MAX_ETHREADS)
+        n = LTHREAD_MAX_ETHREADS;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 0; i < n; i++) {
+        s = ethread_scheds[i];
+        if (s == NULL || s == self || s->current_tid == 0)
+            continue;
+        passes = s->passes;
+        while (s->current_tid != 0 && s->passes == passes) {
+            if (waits++ == LTHREAD_MEMBARRIER_MAX_WAITS &&
+                    host_syscall_SYS_membarrier(MEMBARRIER_CMD_GLOBAL, 0) == 0)
+                goto out;
+            if (lt && !(lt->attr.state & BIT(LT_ST_PINNED)))
+                _lthread_sched_sleep(lt, 0);
+            else
+                a_spin();
+        }
+    }
+out:
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+int syscall_SYS_membarrier(int cmd, int flags) {
+    const int supported = MEMBARRIER_CMD_GLOBAL |
+        MEMBARRIER_CMD_GLOBAL_EXPEDITED |
+        MEMBARRIER_CMD_REGISTER_GLOBAL_EXPEDITED |
+        MEMBARRIER_CMD_PRIVATE_EXPEDITED |
+        MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED;
+
+    if (flags != 0)
+        return -EINVAL;
+
+    switch (cmd) {
+        case MEMBARRIER_CMD_QUERY:
+            return supported;
+        case MEMBARRIER_CMD_GLOBAL:
+        case MEMBARRIER_CMD_GLOBAL_EXPEDITED:
+        case MEMBARRIER_CMD_PRIVATE_EXPEDITED:
+            _lthread_membarrier();
+            return 0;
+        case MEMBARRIER_CMD_REGISTER_GLOBAL_EXPEDITED:
+        case MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED:
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+static void _lthread_park(void) {
+    int active, seq, id = lthread_get_sched()->ethread_id;
+
+    /* lthreads bound to this ethread must not wait for it */
+    if (__ethread_queues && ethread_bound[id])
+        return;
+
+    do {
+        active = active_ethreads;
+        if (active <= 1)
+            return;
+    } while (a_cas(&active_ethreads, active, active - 1) != active);
+    if (__ethread_queues)
+        ethread_parked[id] = 1;
+    a_inc(&__parked_ethreads);
+
+    /*
+     * __scheduler_enqueue either sees us parked or we see its lthread. An
+     * lthread may have been bound to this ethread since the check above.
+     */
+    seq = *park_word;
+    if (__scheduler_queue_depth() == 0 &&
+            !(__ethread_queues && __mpmcq_depth(&__ethread_queues[id]))) {
+        SGXLKL_TRACE_THREAD("[tid=%-3d] lthread_run() parking ethread, active=%d\n", 0, active - 1);
+#ifndef SGXLKL_HW
+        struct timespec timeout = {0, SGXLKL_ETHREAD_PARK_TIMEOUT_NS};
+        lthread_scall(SYS_futex, (long)park_word, FUTEX_WAIT, seq, (long)&timeout);
+#else
+        leave_enclave(SGXLKL_EXIT_PARK, seq);
+#endif
+    }
+
+    if (__ethread_queues)
+        ethread_parked[id] = 0;
+    a_dec(&__parked_ethreads);
+    a_inc(&active_ethreads);
+}
+
+/* Wakes up n parked ethreads */
+static void _lthread_wake_parked(int n) {
+    a_inc(park_word);
+#ifndef SGXLKL_HW
+    lthread_scall(SYS_futex, (long)park_word, FUTEX_WAKE, n, 0);
+#else
+    /* the host wakes up the largest number of ethreads requested */
+    int req;
+    do {
+        req = *unpark_request;
+        if (req >= n)
+            return;
+    } while (a_cas(unpark_request, req, n) != req);
+#endif
+}
+
+void lthread_sched_unpark(void) {
+    if (__scheduler_queue_depth() <= active_ethreads)
+        return;
+    _lthread_wake_parked(1);
+}
+
+/*
+ * Wakes up the given ethread if it is parked. All parked ethreads wait on the
+ * same futex word, so they are all woken up and the others park again.
+ */
+void lthread_sched_unpark_ethread(int ethread) {
+    if (ethread_parked[ethread])
+        _lthread_wake_parked(INT_MAX);
+}
+
 void __schedqueue_inc() {
     a_inc(&schedqueuelen);
 }
 
+/*
+ * Priority queue for LTHREAD_PRIO_HIGH lthreads (e.g. LKL kernel threads).
+ * To avoid starving normal lthreads, the scheduler dequeues a normal lthread
+ * first after LTHREAD_PRIO_AGING consecutive high priority lthreads.
+ */
+#define LTHREAD_PRIO_QUEUE_SIZE 1024
+#define LTHREAD_PRIO_AGING      8
+
+struct mpmcq __scheduler_queue_prio;
+static struct cell_t prio_queue_buffer[LTHREAD_PRIO_QUEUE_SIZE];
+
+static inline int _lthread_sched_dequeue(struct lthread **lt, int *prio_streak) {
+    if (*prio_streak < LTHREAD_PRIO_AGING &&
+            mpmc_dequeue(&__scheduler_queue_prio, (void **)lt)) {
+        (*prio_streak)++;
+        return 1;
+    }
+    *prio_streak = 0;
+    if (mpmc_dequeue(&__scheduler_queue, (void **)lt))
+        return 1;
+    return mpmc_dequeue(&__scheduler_queue_prio, (void **)lt);
+}
+
+int lthread_setpriority(struct lthread *lt, int priority) {
+    if (priority != LTHREAD_PRIO_NORMAL && priority != LTHREAD_PRIO_HIGH)
+        return EINVAL;
+    lt->attr.priority = priority;
+    return 0;
+}
+
+/*
+ * Returns the lthread targeted by a scheduling system call for pid, or a
+ * negative error code. Only the calling thread is supported, either as pid 0
+ * or by its tid (e.g. pthread_setschedparam passes the tid of the thread).
+ */
+static long _lthread_sched_target(pid_t pid, struct lthread **lt) {
+    if (pid < 0)
+        return -EINVAL;
+    *lt = lthread_self();
+    if (*lt == NULL || (pid != 0 && pid != (*lt)->tid))
+        return -ESRCH;
+    return 0;
+}
+
+/*
+ * Maps the realtime policies to LTHREAD_PRIO_HIGH and all other policies to
+ * LTHREAD_PRIO_NORMAL. Static priorities are validated as by Linux but
+ * otherwise ignored.
+ */
+int syscall_SYS_sched_setscheduler(pid_t pid, int policy, const struct sched_param *param) {
+    struct lthread *lt;
+    long ret;
+
+    if (param == NULL)
+        return -EINVAL;
+    if ((ret = _lthread_sched_target(pid, &lt)))
+        return ret;
+    switch (policy & ~SCHED_RESET_ON_FORK) {
+        case SCHED_FIFO:
+        case SCHED_RR:
+            if (param->sched_priority < 1 || param->sched_priority > 99)
+                return -EINVAL;
+            lthread_setpriority(lt, LTHREAD_PRIO_HIGH);
+            return 0;
+        case SCHED_OTHER:
+        case SCHED_BATCH:
+        case SCHED_IDLE:
+            if (param->sched_priority != 0)
+                return -EINVAL;
+            lthread_setpriority(lt, LTHREAD_PRIO_NORMAL);
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+int syscall_SYS_sched_getscheduler(pid_t pid) {
+    struct lthread *lt;
+    long ret;
+
+    if ((ret = _lthread_sched_target(pid, &lt)))
+        return ret;
+    return lt->attr.priority == LTHREAD_PRIO_HIGH ? SCHED_FIFO : SCHED_OTHER;
+}
+
+/*
+ * The following scheduling system calls only depend on lthread and ethread
+ * state. Serving them within the enclave avoids entering LKL, where all
+ * system calls are serialised by the LKL CPU lock.
+ */
+int syscall_SYS_sched_get_priority_max(int policy) {
+    switch (policy) {
+        case SCHED_FIFO:
+        case SCHED_RR:
+            return 99;
+        case SCHED_OTHER:
+        case SCHED_BATCH:
+        case SCHED_IDLE:
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+int syscall_SYS_sched_get_priority_min(int policy) {
+    switch (policy) {
+        case SCHED_FIFO:
+        case SCHED_RR:
+            return 1;
+        case SCHED_OTHER:
+        case SCHED_BATCH:
+        case SCHED_IDLE:
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+int syscall_SYS_sched_getparam(pid_t pid, struct sched_param *param) {
+    struct lthread *lt;
+    long ret;
+
+    if (param == NULL)
+        return -EINVAL;
+    if ((ret = _lthread_sched_target(pid, &lt)))
+        return ret;
+    param->sched_priority = lt->attr.priority == LTHREAD_PRIO_HIGH ? 1 : 0;
+    return 0;
+}
+
+int syscall_SYS_sched_setparam(pid_t pid, const struct sched_param *param) {
+    struct lthread *lt;
+    long ret;
+
+    if (param == NULL)
+        return -EINVAL;
+    if ((ret = _lthread_sched_target(pid, &lt)))
+        return ret;
+    /* only realtime policies have a non-zero static priority */
+    if (lt->attr.priority == LTHREAD_PRIO_HIGH)
+        return param->sched_priority >= 1 && param->sched_priority <= 99 ? 0 : -EINVAL;
+    return param->sched_priority == 0 ? 0 : -EINVAL;
+}
+
+int syscall_SYS_sched_rr_get_interval(pid_t pid, struct timespec *ts) {
+    struct lthread *lt;
+    long ret;
+
+    if ((ret = _lthread_sched_target(pid, &lt)))
+        return ret;
+    if (ts == NULL)
+        return -EFAULT;
+    /* without a timeslice lthreads run until they yield */
+    ts->tv_sec = timeslice_usecs / 1000000;
+    ts->tv_nsec = (timeslice_usecs % 1000000) * 1000;
+    return 0;
+}
+
+/*
+ * Applications call sched_yield in spin loops, often at a high rate. Serving
+ * it within the enclave yields to other lthreads directly instead of taking
+ * the LKL CPU lock. Pinned lthreads and code running outside of an lthread
+ * cannot yield.
+ */
+int syscall_SYS_sched_yield(void) {
+    struct lthread *lt = lthread_self();
+    if (lt != NULL && !(lt->attr.state & BIT(LT_ST_PINNED)))
+        _lthread_sched_sleep(lt, 0);
+    return 0;
+}
+
+/* Lthread ids are the thread ids seen by musl, see _lthread_sched_target */
+pid_t syscall_SYS_gettid(void) {
+    struct lthread *lt = lthread_self();
+    return lt != NULL ? lt->tid : host_syscall_SYS_gettid();
+}
+
+/* Ethreads are reported as CPUs, see syscall_SYS_sched_setaffinity */
+int syscall_SYS_getcpu(unsigned *cpu, unsigned *node, void *tcache) {
+    if (cpu)
+        *cpu = lthread_get_sched()->ethread_id;
+    if (node)
+        *node = 0;
+    return 0;
+}
+
 void lthread_sched_global_init(size_t sleepspins_, size_t sleeptime_ns_, size_t futex_wake_spins_) {
+        newmpmcq(&__scheduler_queue_prio, sizeof(prio_queue_buffer), prio_queue_buffer);
         sleepspins = sleepspins_;
         sleeptime_ns = sleeptime_ns_;
         futex_wake_spins = futex_wake_spins_;
@@ -197,6 +733,9 @@ void lthread_run(void) {
     size_t s, pauses = sleepspins;
     struct timespec sleeptime = {0, sleeptime_ns};
     int spins = futex_wake_spins;
+    size_t idle = 0;
+    int prio_streak = 0;
+    int kernel_ethread;
     int dequeued;
     size_t i;
     struct mpmcq *retq = __return_queue;
@@ -205,6 +744,7 @@ void lthread_run(void) {
         return;
     }
     for (;;) {
+        kernel_ethread = sched->ethread_id < __kernel_ethreads;
         /* start by checking if a sleeping thread needs to wakeup */
         do {
             dequeued = 0;
@@ -212,21 +752,46 @@ void lthread_run(void) {
                 dequeued++;
                 lt = slottolthread(s);
                 pauses = sleepspins;
-                SGXLKL_TRACE_THREAD("[tid=%-3d] lthread_run() lthread_resume (wakeup sleeping thread) \n", lt->tid);
-                _lthread_resume(lt);
+                if ((lt->affinity && lt->affinity - 1 != sched->ethread_id) ||
+                    (!lt->affinity && __kernel_ethreads && _lthread_is_kernel(lt) != kernel_ethread)) {
+                    /* hand over to an ethread of the right kind */
+                    __scheduler_enqueue(lt);
+                } else {
+                    SGXLKL_TRACE_THREAD("[tid=%-3d] lthread_run() lthread_resume (wakeup sleeping thread) \n", lt->tid);
+                    _lthread_resume(lt);
+                }
             }
-            if (mpmc_dequeue(&__scheduler_queue, (void **)&lt)) {
+            if ((__ethread_queues && mpmc_dequeue(&__ethread_queues[sched->ethread_id], (void **)&lt)) ||
+                (kernel_ethread ? mpmc_dequeue(&__scheduler_queue_kernel, (void **)&lt)
+                                : _lthread_sched_dequeue(&lt, &prio_streak))) {
                 dequeued++;
                 pauses = sleepspins;
                 a_dec(&schedqueuelen);
                 SGXLKL_TRACE_THREAD("[tid=%-3d] lthread_run() lthread_resume (dequeue sched queue) \n", lt->tid);
                 _lthread_resume(lt);
             }
+            /* keep expiring timeouts while the queues are never empty */
+            if (dequeued && --spins <= 0) {
+                futex_tick();
+                _lthread_resume_expired();
+                spins = futex_wake_spins;
+            }
+            if (dequeued)
+                idle = 0;
         } while (dequeued);
 
+        if (park_enabled && !kernel_ethread && ++idle >= LTHREAD_PARK_SPINS) {
+            idle = 0;
+            _lthread_park();
+            pauses = sleepspins;
+            spins = 0;
+        }
+
         spins--;
         if (spins <= 0) {
             futex_tick();
+            _lthread_resume_expired();
+            enclave_mmap_zero_idle();
             spins = futex_wake_spins;
         }
 
@@ -235,7 +800,7 @@ void lthread_run(void) {
             pauses = sleepspins;
             spins = 0;
 #ifndef SGXLKL_HW
-            lthread_scall(SYS_nanosleep, (long)&sleeptime, (long)NULL, 0L);
+            lthread_scall(SYS_nanosleep, (long)&sleeptime, (long)NULL, 0L, 0L);
 #else
             leave_enclave(SGXLKL_EXIT_SLEEP, sleeptime_ns);
 #endif
@@ -244,13 +809,9 @@ void lthread_run(void) {
 }
 
 /*
- * Removes lthread from sleeping rbtree.
- * This can be called multiple times on the same lthread regardless if it was
- * sleeping or not.
+ * Removes lthread from sleeping rbtree. Must be called with sleeplock held.
  */
-void _lthread_desched_sleep(struct lthread *lt) {
-    ticket_lock(&sleeplock);
-    SGXLKL_TRACE_THREAD("[tid=%-3d] _lthread_desched_sleep() TICKET_LOCK lock=SLEEPLOCK tid=%d \n", (lthread_self() ? lthread_self()->tid : 0), lt->tid);
+static void _lthread_sleep_remove(struct lthread *lt) {
     if (lt->attr.state & BIT(LT_ST_SLEEPING)) {
         RB_REMOVE(lthread_rb_sleep, &_lthread_sleeping, lt);
         lt->attr.state &= CLEARBIT(LT_ST_SLEEPING);
@@ -258,47 +819,235 @@ void _lthread_desched_sleep(struct lthread *lt) {
         lt->attr.state &= CLEARBIT(LT_ST_EXPIRED);
         nsleepers--;
     }
+}
+
+/*
+ * Removes lthread from sleeping rbtree.
+ * This can be called multiple times on the same lthread regardless if it was
+ * sleeping or not.
+ */
+void _lthread_desched_sleep(struct lthread *lt) {
+    ticket_lock(&sleeplock);
+    SGXLKL_TRACE_THREAD("[tid=%-3d] _lthread_desched_sleep() TICKET_LOCK lock=SLEEPLOCK tid=%d \n", (lthread_self() ? lthread_self()->tid : 0), lt->tid);
+
+    _lthread_sleep_remove(lt);
 
    ticket_unlock(&sleeplock);
 
    SGXLKL_TRACE_THREAD("[tid=%-3d] _lthread_desched_sleep() TICKET_UNLOCK lock=SLEEPLOCK tid=%d\n", (lthread_self() ? lthread_self()->tid : 0), lt->tid);
 }
 
+static void _lthread_sleep_unlock(void *lock) {
+    ticket_unlock((struct ticketlock *)lock);
+}
+
 /*
- * Resumes expired lthread and cancels its events whether it was waiting
- * on one or not, and deschedules it from sleeping rbtree in case it was
- * sleeping.
+ * Puts lt to sleep for usecs microseconds on the sleeping rbtree. Sleepers are
+ * woken up by the scheduler tick once their deadline has passed, or earlier by
+ * lthread_wakeup(). sleeplock is only released in the yield callback so that
+ * lt cannot be rescheduled before it has switched out. A wakeup that was
+ * delivered while lt was not sleeping is consumed instead of going to sleep.
  */
-static void _lthread_resume_expired(struct timespec *now) {
-    struct lthread *lt = NULL;
-    uint64_t curr_usec = 0;
+/*
+ * Reports a timeslice overrun recorded by _lthread_account. Called by lt
+ * itself once it runs again, as host calls from the scheduler would yield lt.
+ */
+static void _lthread_report_overrun(struct lthread *lt) {
+    char buf[192];
+    uint64_t ran = lt->slice_overrun;
+    int n;
 
-    if (nsleepers == 0) {
+    if (!ran)
+        return;
+    lt->slice_overrun = 0;
+
+    n = snprintf(buf, sizeof(buf), "[    SGX-LKL   ] Warning: lthread %d (%s) ran for %llu us without yielding (timeslice: %llu us)\n",
+                 lt->tid, lt->funcname, (unsigned long long)ran, (unsigned long long)timeslice_usecs);
+    if (n > 0)
+        host_syscall_SYS_write(STDERR_FILENO, buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
+
+void _lthread_sched_sleep(struct lthread *lt, uint64_t usecs) {
+    struct timespec now;
+
+    if (usecs == 0) {
+        _lthread_yield_cb(lt, (void *)__scheduler_enqueue, lt);
+        _lthread_report_overrun(lt);
         return;
     }
 
+    /* clock_gettime may be a host call, don't hold sleeplock across it */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
     ticket_lock(&sleeplock);
+    if (lt->wakeup_pending) {
+        lt->wakeup_pending = 0;
+        ticket_unlock(&sleeplock);
+        return;
+    }
 
-    SGXLKL_TRACE_THREAD("[tid=%-3d] _lthread_resume_expired() TICKET_LOCK lock=SLEEPLOCK tid=NULL\n", (lthread_self() ? lthread_self()->tid : 0));
+    lt->sleep_usecs = _lthread_timespec_to_usec(&now) + usecs;
+    /* the rbtree does not allow duplicate keys */
+    while (RB_INSERT(lthread_rb_sleep, &_lthread_sleeping, lt) != NULL)
+        lt->sleep_usecs++;
+    lt->attr.state |= BIT(LT_ST_SLEEPING);
+    nsleepers++;
 
-    curr_usec = _lthread_timespec_to_usec(now);
-    while ((lt = RB_MIN(lthread_rb_sleep, &_lthread_sleeping)) != NULL) {
+    SGXLKL_TRACE_THREAD("[tid=%-3d] _lthread_sched_sleep() usecs=%llu\n", lt->tid, (unsigned long long)usecs);
 
-        if (lt->sleep_usecs <= curr_usec) {
-            _lthread_desched_sleep(lt);
-            lthread_set_expired(lt);
+    _lthread_yield_cb(lt, _lthread_sleep_unlock, &sleeplock);
+    _lthread_report_overrun(lt);
+}
 
-            /* don't clear expired if lthread exited/cancelled */
-            if (_lthread_resume(lt) != -1)
-                lt->attr.state &= CLEARBIT(LT_ST_EXPIRED);
+/*
+ * Sleeps are serviced within the enclave on the sleeping rbtree so that a
+ * sleeping lthread does not occupy a host syscall thread. _lthread_sched_sleep
+ * may return early (e.g. due to lthread_wakeup()), so we sleep until the
+ * deadline has passed. lthreads pinned to their ethread and code running
+ * outside of an lthread cannot yield and sleep on the host instead.
+ */
+int syscall_SYS_clock_nanosleep(clockid_t clk, int flags,
+                                const struct timespec *req, struct timespec *rem) {
+    struct lthread *lt = lthread_self();
+    struct timespec now;
+    uint64_t deadline, curr_usec;
+
+    if (req == NULL || req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000L)
+        return -EINVAL;
+
+    switch (clk) {
+        case CLOCK_REALTIME:
+        case CLOCK_MONOTONIC:
+        case CLOCK_BOOTTIME:
+            break;
+        default:
+            return -EINVAL;
+    }
 
-            continue;
+    if (lt == NULL || (lt->attr.state & BIT(LT_ST_PINNED))) {
+        struct timespec rel = *req;
+        if (flags & TIMER_ABSTIME) {
+            clock_gettime(clk, &now);
+            rel.tv_sec -= now.tv_sec;
+            rel.tv_nsec -= now.tv_nsec;
+            if (rel.tv_nsec < 0) {
+                rel.tv_sec--;
+                rel.tv_nsec += 1000000000L;
+            }
+            if (rel.tv_sec < 0)
+                return 0;
+            rem = NULL;
         }
-        break;
+        return host_syscall_SYS_nanosleep(&rel, rem);
     }
-    ticket_unlock(&sleeplock);
 
-    SGXLKL_TRACE_THREAD("[tid=%-3d] _lthread_resume_expired() TICKET_UNLOCK lock=SLEEPLOCK tid=NULL\n", (lthread_self() ? lthread_self()->tid : 0));
+    clock_gettime(clk, &now);
+    /* round up to the next microsecond, we must not return too early */
+    deadline = _lthread_timespec_to_usec(req) + (req->tv_nsec % 1000 ? 1 : 0);
+    if (!(flags & TIMER_ABSTIME))
+        deadline += _lthread_timespec_to_usec(&now);
+
+    while ((curr_usec = _lthread_timespec_to_usec(&now)) < deadline) {
+        _lthread_sched_sleep(lt, deadline - curr_usec);
+        clock_gettime(clk, &now);
+    }
+
+    if (rem != NULL && !(flags & TIMER_ABSTIME))
+        rem->tv_sec = rem->tv_nsec = 0;
+
+    return 0;
+}
+
+int syscall_SYS_nanosleep(const struct timespec *req, struct timespec *rem) {
+    return syscall_SYS_clock_nanosleep(CLOCK_MONOTONIC, 0, req, rem);
+}
+
+static inline uint64_t _lthread_now_usecs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return _lthread_timespec_to_usec(&now);
+}
+
+/*
+ * Called by the scheduler after lt switched out if a timeslice is set
+ * (SGXLKL_TIMESLICE). lthreads that kept their ethread for longer than the
+ * timeslice starve all lthreads queued behind them, so they are reported.
+ * Further overruns of the same lthread are only reported once they have
+ * doubled. We are on the scheduler stack here, so the report is left to the
+ * lthread itself (see _lthread_report_overrun).
+ */
+static void _lthread_account(struct lthread *lt) {
+    uint64_t ran = _lthread_now_usecs() - lt->resumed_usecs;
+
+    lt->run_usecs += ran;
+    if (ran <= timeslice_usecs || ran < 2 * lt->slice_reported)
+        return;
+    lt->slice_reported = ran;
+    lt->slice_overrun = ran;
+}
+
+/*
+ * Yield point for long-running code. Yields if the timeslice of the current
+ * lthread has expired. The clock is only read every LTHREAD_YIELD_POINT_OPS
+ * calls, so this is cheap enough to be called on every function entry of
+ * applications compiled with -finstrument-functions (see below). Pinned
+ * lthreads cannot yield.
+ */
+void lthread_yield_point(void) {
+    struct lthread *lt;
+
+    if (!timeslice_usecs || (lt = lthread_self()) == NULL)
+        return;
+    if (++lt->ops < LTHREAD_YIELD_POINT_OPS)
+        return;
+    lt->ops = 0;
+    if (lt->attr.state & BIT(LT_ST_PINNED))
+        return;
+    if (_lthread_now_usecs() - lt->resumed_usecs < timeslice_usecs)
+        return;
+
+    SGXLKL_TRACE_THREAD("[tid=%-3d] lthread_yield_point() timeslice expired\n", lt->tid);
+    _lthread_sched_sleep(lt, 0);
+}
+
+static void _lthread_func_enter(void *fn, void *site) {
+    lthread_yield_point();
+}
+
+static void _lthread_func_exit(void *fn, void *site) {}
+
+weak_alias(_lthread_func_enter, __cyg_profile_func_enter);
+weak_alias(_lthread_func_exit, __cyg_profile_func_exit);
+
+/*
+ * Moves all sleeping lthreads whose deadline has passed back to the scheduler
+ * queue. Called on a scheduler tick.
+ */
+static void _lthread_resume_expired(void) {
+    struct lthread *lt = NULL;
+    struct timespec now;
+    uint64_t curr_usec = 0;
+
+    if (nsleepers == 0) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    curr_usec = _lthread_timespec_to_usec(&now);
+
+    /* another scheduler is already expiring sleepers */
+    if (ticket_trylock(&sleeplock) == EBUSY)
+        return;
+
+    while ((lt = RB_MIN(lthread_rb_sleep, &_lthread_sleeping)) != NULL) {
+        if (lt->sleep_usecs > curr_usec)
+            break;
+
+        _lthread_sleep_remove(lt);
+        SGXLKL_TRACE_THREAD("[tid=%-3d] _lthread_resume_expired() wakeup tid=%d\n", (lthread_self() ? lthread_self()->tid : 0), lt->tid);
+        __scheduler_enqueue(lt);
+    }
+    ticket_unlock(&sleeplock);
 }
 
 static void _lthread_lock(struct lthread *lt) {
@@ -329,8 +1078,111 @@ void _lthread_yield(struct lthread *lt) {
     _switch(&sched->ctx, &lt->ctx);
 }
 
+/*
+ * Cache of lthread shells of freed lthreads. A shell is a zeroed lthread
+ * struct that still owns its stack and its syscall arena, so that
+ * lthread_create can reuse it without mapping a new stack and without a host
+ * mmap for the arena. Shells are grouped by stack size, each bucket is claimed
+ * by the first stack size that is returned to it while empty.
+ */
+#define LTHREAD_CACHE_BUCKETS   4
+#define LTHREAD_CACHE_MAX       64 /* max number of shells per bucket */
+
+/*
+ * Lthread stacks are taken directly from the enclave mmap range without being
+ * zeroed, so that in simulation mode their pages are only committed by the
+ * host once they are touched. Before a shell with a deep stack is cached, the
+ * part of the stack beyond LTHREAD_STACK_KEEP is released again. With SGX1,
+ * EPC pages cannot be released, there the cache serves as a pool of stacks.
+ */
+#define LTHREAD_STACK_KEEP      (64 * 1024)
+
+static void *_lthread_stack_alloc(size_t stack_size) {
+    void *stack = enclave_mmap(0, stack_size, 0);
+    // Free pages keep the protection of their last mapping.
+    if (stack != MAP_FAILED && mprotect(stack, stack_size, PROT_READ | PROT_WRITE)) {
+        enclave_munmap(stack, stack_size);
+        return MAP_FAILED;
+    }
+    return stack;
+}
+
+static void _lthread_stack_free(void *stack, size_t stack_size) {
+    enclave_munmap(stack, stack_size);
+}
+
+static void _lthread_stack_reclaim(void *stack, size_t stack_size, size_t max_used) {
+#ifndef SGXLKL_HW
+    if (max_used > LTHREAD_STACK_KEEP && stack_size > LTHREAD_STACK_KEEP)
+        host_syscall_SYS_madvise(stack, stack_size - LTHREAD_STACK_KEEP, MADV_DONTNEED);
+#endif /* SGXLKL_HW */
+}
+
+struct lthread_cache_bucket {
+    size_t                  stack_size;
+    size_t                  count;
+    struct lthread          *head;
+};
+
+static struct lthread_cache_bucket lthread_cache[LTHREAD_CACHE_BUCKETS];
+static struct ticketlock lthread_cache_lock;
+
+static struct lthread *_lthread_cache_get(size_t stack_size) {
+    struct lthread_cache_bucket *b;
+    struct lthread *lt = NULL;
+    int i;
+
+    ticket_lock(&lthread_cache_lock);
+    for (i = 0; i < LTHREAD_CACHE_BUCKETS; i++) {
+        b = &lthread_cache[i];
+        if (b->count && b->stack_size == stack_size) {
+            lt = b->head;
+            b->head = lt->cache_next;
+            b->count--;
+            lt->cache_next = NULL;
+            break;
+        }
+    }
+    ticket_unlock(&lthread_cache_lock);
+
+    return lt;
+}
+
+/* Returns 1 if lt was added to the cache, 0 if the cache is full. */
+static int _lthread_cache_put(struct lthread *lt) {
+    struct lthread_cache_bucket *b, *empty = NULL;
+    int i, ret = 0;
+
+    ticket_lock(&lthread_cache_lock);
+    for (i = 0; i < LTHREAD_CACHE_BUCKETS; i++) {
+        b = &lthread_cache[i];
+        if (b->count && b->stack_size == lt->attr.stack_size)
+            break;
+        if (!b->count && !empty)
+            empty = b;
+    }
+    if (i == LTHREAD_CACHE_BUCKETS) {
+        b = empty;
+        if (b)
+            b->stack_size = lt->attr.stack_size;
+    }
+    if (b && b->count < LTHREAD_CACHE_MAX) {
+        lt->cache_next = b->head;
+        b->head = lt;
+        b->count++;
+        ret = 1;
+    }
+    ticket_unlock(&lthread_cache_lock);
+
+    return ret;
+}
+
 void _lthread_free(struct lthread *lt) {
     volatile void *volatile *rp;
+    void *stack;
+    size_t stack_size;
+    int stack_owned;
+    Arena arena;
     while (lt->cancelbuf) {
         void (*f)(void *) = lt->cancelbuf->__f;
         void *x = lt->cancelbuf->__x;
@@ -339,6 +1191,7 @@ void _lthread_free(struct lthread *lt) {
     }
     if(lthread_self() != NULL)
         lthread_rundestructors(lt);
+    free(lt->tls_direct);
     if (lt->itls != 0) {
         munmap(lt->itls, lt->itlssz);
     }
@@ -355,10 +1208,13 @@ void _lthread_free(struct lthread *lt) {
             __wake(&m->_m_lock, 1, priv);
     }
     __do_orphaned_stdio_locks(lt);
-    if (lt->attr.stack) {
-        munmap(lt->attr.stack, lt->attr.stack_size);
-        lt->attr.stack = NULL;
-    }
+    stack = lt->attr.stack;
+    stack_size = lt->attr.stack_size;
+    stack_owned = lt->stack_owned;
+    if (stack_owned)
+        _lthread_stack_reclaim(stack, stack_size, lt->attr.max_stack_size);
+    arena = lt->syscallarena;
+    lthread_setaffinity(lt, -1);
     freeslot(lt->syscall);
     memset(lt, 0, sizeof(*lt));
     if (a_fetch_add(&libc.threads_minus_1, -1) == 0) {
@@ -390,6 +1246,23 @@ void _lthread_free(struct lthread *lt) {
     }
 #endif /* DEBUG */
 
+    /* keep the stack and the syscall arena for the next lthread_create */
+    if (stack && stack_owned) {
+        lt->attr.stack = stack;
+        lt->attr.stack_size = stack_size;
+        lt->stack_owned = 1;
+        arena_free(&arena);
+        lt->syscallarena = arena;
+        if (_lthread_cache_put(lt))
+            return;
+    }
+
+    if (stack && stack_owned) {
+        _lthread_stack_free(stack, stack_size);
+    } else if (stack) {
+        munmap(stack, stack_size);
+    }
+    arena_destroy(&arena);
     free(lt);
     lt = 0;
 }
@@ -416,17 +1289,25 @@ int _lthread_resume(struct lthread *lt) {
     lt->yield_cb = 0;
     lt->yield_cbarg = 0;
 
+    /* clock_gettime may be a host call, which would yield current_lthread */
+    if (timeslice_usecs)
+        lt->resumed_usecs = _lthread_now_usecs();
     sched->current_lthread = lt;
     sched->current_syscallslot = lt->syscall;
     sched->current_arena = &lt->syscallarena;
+    /* pairs with the fence in _lthread_membarrier */
+    a_store(&sched->current_tid, lt->tid);
     _switch(&lt->ctx, &sched->ctx);
+    sched->current_tid = 0;
+    sched->passes++;
     sched->current_arena = &sched->arena;
     sched->current_syscallslot = sched->syscall;
     sched->current_lthread = NULL;
+    if (timeslice_usecs)
+        _lthread_account(lt);
     _lthread_madvise(lt);
     if (lt->attr.state & BIT(LT_ST_EXITED)) {
         /* lt is always locked before LT_ST_EXITED is set */
-        arena_destroy(&lt->syscallarena);
         if (lt->lt_join) {
             __scheduler_enqueue(lt->lt_join);
             lt->lt_join = NULL;
@@ -452,6 +1333,8 @@ static inline void _lthread_madvise(struct lthread *lt) {
     /* make sure function did not overflow stack, we can't recover from that */
     assert(current_stack <= lt->attr.stack_size);
     lt->attr.last_stack_size = current_stack;
+    if (current_stack > lt->attr.max_stack_size)
+        lt->attr.max_stack_size = current_stack;
 }
 
 int lthread_init(size_t size) {
@@ -494,6 +1377,9 @@ int _lthread_sched_init(size_t stack_size) {
     c->sched.page_size = sysconf(_SC_PAGESIZE);
 
     c->sched.default_timeout = 3000000u;
+    c->sched.ethread_id = a_fetch_add(&ethreads_started, 1);
+    if (c->sched.ethread_id < LTHREAD_MAX_ETHREADS)
+        ethread_scheds[c->sched.ethread_id] = &c->sched;
 
     memset(&c->sched.ctx, 0, sizeof(struct cpu_ctx));
 
@@ -524,28 +1410,44 @@ int lthread_create(struct lthread **new_lt, struct lthread_attr *attrp, void *fu
     }
 
     stack_size = attrp && attrp->stack_size ? attrp->stack_size : sched->stack_size;
+    /* reuse the shell of a freed lthread if there is one */
+    if (!(attrp && attrp->stack)) {
+        stack_size = (stack_size + sched->page_size - 1) & ~(sched->page_size - 1);
+        if ((lt = _lthread_cache_get(stack_size)) != NULL)
+            goto init_tls;
+    }
     if ((lt = calloc(1, sizeof(struct lthread))) == NULL) {
         return (errno);
     }
     lt->attr.stack = attrp ? attrp->stack : 0;
-    if ((!lt->attr.stack)&&((lt->attr.stack = mmap(0, stack_size, PROT_READ|PROT_WRITE,
-                                                  MAP_ANONYMOUS|MAP_PRIVATE,
-                                                   -1, 0)) == MAP_FAILED)) {
-        free(lt);
-        return (errno);
+    if (!lt->attr.stack) {
+        if ((lt->attr.stack = _lthread_stack_alloc(stack_size)) == MAP_FAILED) {
+            free(lt);
+            return (errno);
+        }
+        lt->stack_owned = 1;
     }
     lt->attr.stack_size = stack_size;
+    arena_new(&lt->syscallarena, 4096);
+init_tls:
     /* mmap main tls image */
     if (!__copy_utls(&lt->itls, &lt->itlssz)) {
-        munmap(lt->attr.stack, stack_size);
-        free(lt);
+        if (!lt->stack_owned) {
+            munmap(lt->attr.stack, stack_size);
+            arena_destroy(&lt->syscallarena);
+            free(lt);
+        } else if (!_lthread_cache_put(lt)) {
+            _lthread_stack_free(lt->attr.stack, stack_size);
+            arena_destroy(&lt->syscallarena);
+            free(lt);
+        }
         return (errno);
     }
     lt->attr.state = BIT(LT_ST_NEW) | (attrp ? attrp->state : 0);
+    lt->attr.priority = attrp ? attrp->priority : LTHREAD_PRIO_NORMAL;
     lt->tid = a_fetch_add(&spawned_lthreads, 1);
     lt->fun = fun;
     lt->arg = arg;
-    arena_new(&lt->syscallarena, 4096);
     lt->locale = &libc.global_locale;
     if (new_lt) {
         *new_lt = lt;
@@ -604,9 +1506,23 @@ void lthread_cancel(struct lthread *lt) {
 //    }
 //}
 
+/*
+ * Wakes up lt if it is sleeping. Otherwise the wakeup is remembered and its
+ * next _lthread_sched_sleep() returns immediately.
+ */
 void lthread_wakeup(struct lthread *lt) {
-    if (lt->attr.state & BIT(LT_ST_SLEEPING)) {
-        _lthread_desched_sleep(lt);
+    int sleeping;
+
+    ticket_lock(&sleeplock);
+    sleeping = lt->attr.state & BIT(LT_ST_SLEEPING);
+    if (sleeping) {
+        _lthread_sleep_remove(lt);
+    } else {
+        lt->wakeup_pending = 1;
+    }
+    ticket_unlock(&sleeplock);
+
+    if (sleeping) {
         __scheduler_enqueue(lt);
     }
 }
@@ -738,8 +1654,23 @@ static int lthread_addtlsslot(pthread_key_t key, void *data) {
     return 0;
 }
 
+/*
+ * Destructors and generations of direct TLS keys. The generation of a slot is
+ * odd while its key exists and is incremented by lthread_key_create() and
+ * lthread_key_delete().
+ */
+typedef void (*lthread_destructor_func)(void*);
+static lthread_destructor_func lthread_destructors_direct[LTHREAD_TLS_DIRECT_KEYS];
+static volatile int lthread_keys_direct_gen[LTHREAD_TLS_DIRECT_KEYS];
+
 void *lthread_getspecific(pthread_key_t key) {
     struct lthread_tls *d;
+    if (key < LTHREAD_TLS_DIRECT_KEYS) {
+        struct lthread_tls_direct *tls_direct = lthread_current()->tls_direct;
+        if (tls_direct && tls_direct[key].gen == lthread_keys_direct_gen[key])
+            return tls_direct[key].data;
+        return NULL;
+    }
     if ((d = lthread_findtlsslot(key)) == NULL) {
         return NULL;
     }
@@ -748,6 +1679,20 @@ void *lthread_getspecific(pthread_key_t key) {
 
 int lthread_setspecific(pthread_key_t key, const void *value) {
     struct lthread_tls *d;
+    if (key < LTHREAD_TLS_DIRECT_KEYS) {
+        struct lthread *lt = lthread_current();
+        /* allocated lazily, most lthreads never use TLS keys */
+        if (lt->tls_direct == NULL) {
+            if (value == NULL)
+                return 0;
+            lt->tls_direct = calloc(LTHREAD_TLS_DIRECT_KEYS, sizeof(*lt->tls_direct));
+            if (lt->tls_direct == NULL)
+                return ENOMEM;
+        }
+        lt->tls_direct[key].data = (void *)value;
+        lt->tls_direct[key].gen = lthread_keys_direct_gen[key];
+        return 0;
+    }
     if ((d = lthread_findtlsslot(key)) != NULL) {
         d->data = (void *)value;
         return 0;
@@ -757,17 +1702,35 @@ int lthread_setspecific(pthread_key_t key, const void *value) {
 }
 
 static struct lthread_tlsdestr_l lthread_destructors;
-typedef void (*lthread_destructor_func)(void*);
 
+/* Keys of the destructor list, allocated once all direct keys are in use. */
 static unsigned global_count = 0;
 
+static int lthread_key_create_direct(pthread_key_t *k, void (*destructor)(void*)) {
+    pthread_key_t key;
+    int gen;
+
+    for (key = 0; key < LTHREAD_TLS_DIRECT_KEYS; key++) {
+        gen = lthread_keys_direct_gen[key];
+        if (!(gen & 1) && a_cas(&lthread_keys_direct_gen[key], gen, (int)((unsigned)gen + 1)) == gen) {
+            lthread_destructors_direct[key] = destructor;
+            *k = key;
+            return 0;
+        }
+    }
+    return -1;
+}
+
 int lthread_key_create(pthread_key_t *k, void (*destructor)(void*)) {
     struct lthread_tls_destructors *d;
+    if (lthread_key_create_direct(k, destructor) == 0) {
+        return 0;
+    }
     d = calloc(1, sizeof(struct lthread_tls_destructors));
     if (d == NULL) {
         return ENOMEM;
     }
-    d->key = a_fetch_add((void *)&global_count, 1);
+    d->key = LTHREAD_TLS_DIRECT_KEYS + a_fetch_add((void *)&global_count, 1);
     d->destructor = destructor;
     LIST_INSERT_HEAD(&lthread_destructors, d, tlsdestr_next);
     *k = d->key;
@@ -776,6 +1739,16 @@ int lthread_key_create(pthread_key_t *k, void (*destructor)(void*)) {
 
 int lthread_key_delete(pthread_key_t key) {
     struct lthread_tls_destructors *d, *d_tmp;
+    int gen;
+    if (key < LTHREAD_TLS_DIRECT_KEYS) {
+        gen = lthread_keys_direct_gen[key];
+        if (!(gen & 1))
+            return EINVAL;
+        lthread_destructors_direct[key] = NULL;
+        if (a_cas(&lthread_keys_direct_gen[key], gen, (int)((unsigned)gen + 1)) != gen)
+            return EINVAL;
+        return 0;
+    }
     LIST_FOREACH_SAFE (d, &lthread_destructors, tlsdestr_next, d_tmp) {
         if (d->key == key) {
             LIST_REMOVE(d, tlsdestr_next);
@@ -783,7 +1756,7 @@ int lthread_key_delete(pthread_key_t key) {
             return 0;
         }
     }
-    return -1;
+    return EINVAL;
 }
 
 static lthread_destructor_func lthread_finddestr(pthread_key_t key) {
@@ -799,6 +1772,23 @@ static lthread_destructor_func lthread_finddestr(pthread_key_t key) {
 static void lthread_rundestructors(struct lthread *lt) {
     struct lthread_tls *d, *d_tmp;
     lthread_destructor_func destr;
+    void *data;
+    pthread_key_t key;
+
+    if (lt->tls_direct) {
+        for (key = 0; key < LTHREAD_TLS_DIRECT_KEYS; key++) {
+            data = lt->tls_direct[key].data;
+            destr = lthread_destructors_direct[key];
+            if (data && destr &&
+                lt->tls_direct[key].gen == lthread_keys_direct_gen[key]) {
+                lt->tls_direct[key].data = NULL;
+                destr(data);
+            }
+        }
+        free(lt->tls_direct);
+        lt->tls_direct = NULL;
+    }
+
     LIST_FOREACH_SAFE (d, &lt->tls, tls_next, d_tmp) {
         if (d->data) {
                 destr = lthread_finddestr(d->key);
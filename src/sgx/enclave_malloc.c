@@ -0,0 +1,411 @@
+/*
+ * Copyright 2016, 2017, 2018 Imperial College London
+ */
+
+/*
+ * Multi-arena malloc with per-ethread caches, compiled if SGXLKL_ARENA_MALLOC
+ * is defined (make ARENA_MALLOC=true). It replaces musl's malloc, which
+ * serialises all threads on a single lock. The Makefile makes the allocation
+ * functions of musl's malloc local, so that these are linked instead.
+ *
+ * Small requests are served from size classes. Each ethread keeps a cache of
+ * free blocks per class, backed by a small number of shared arenas. Caches
+ * are per ethread rather than per lthread: lthreads are scheduled
+ * cooperatively and do not yield while manipulating a cache, so a cache needs
+ * no locking, whereas per-lthread caches would strand memory in the many
+ * short-lived or blocked lthreads. Anything that may yield (mmap) is done
+ * without holding a cache, and the cache is looked up again afterwards as the
+ * lthread may have been resumed on a different ethread.
+ *
+ * Large requests are mapped directly and can be resized in place by mremap.
+ * Memory of small size classes is kept by the arenas and not returned.
+ */
+
+#ifdef SGXLKL_ARENA_MALLOC
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "lthread.h"
+#include "pthread_impl.h"
+#include "ticketlock.h"
+
+#define MALLOC_ALIGN        16
+#define MALLOC_NUM_CLASSES  40
+#define MALLOC_MAX_SMALL    32768
+#define MALLOC_NUM_ARENAS   8
+#define MALLOC_MAX_ETHREADS 1024
+#define MALLOC_SPAN_SIZE    (64 * 1024)
+#define MALLOC_SPAN_BLOCKS  16
+#define MALLOC_CACHE_BYTES  (64 * 1024)
+#define MALLOC_CACHE_MAX    256
+#define MALLOC_CACHE_MIN    4
+#define CLASS_LARGE         UINT32_MAX
+
+#define ROUNDUP(x, y)       (((x) + ((y) - 1)) / (y) * (y))
+
+/*
+ * Header in front of every block. For small blocks, cls is the size class.
+ * For large blocks, size is the length of the mapping and offset is the
+ * distance from the start of the mapping to the header (non-zero only for
+ * blocks with alignment greater than MALLOC_ALIGN).
+ */
+struct chunk {
+    uint32_t cls;
+    uint32_t offset;
+    size_t size;
+};
+
+/* Free small blocks are linked through their payload. */
+struct free_block {
+    struct chunk hdr;
+    struct free_block *next;
+};
+
+struct arena {
+    struct ticketlock lock;
+    struct free_block *head[MALLOC_NUM_CLASSES];
+};
+
+struct tcache {
+    struct free_block *head[MALLOC_NUM_CLASSES];
+    uint32_t count[MALLOC_NUM_CLASSES];
+};
+
+static struct arena arenas[MALLOC_NUM_ARENAS];
+static struct tcache *tcaches[MALLOC_MAX_ETHREADS];
+
+/*
+ * Classes 0-7 are multiples of 16 bytes up to 128 bytes. Above that, each
+ * power of two is split into four classes, up to MALLOC_MAX_SMALL.
+ */
+static inline size_t class_size(unsigned cls) {
+    size_t p;
+
+    if (cls < 8)
+        return MALLOC_ALIGN * (cls + 1);
+    p = (size_t) 1 << (7 + (cls - 8) / 4);
+    return p + ((cls - 8) % 4 + 1) * (p / 4);
+}
+
+static inline unsigned size_to_class(size_t n) {
+    unsigned b;
+    size_t p;
+
+    if (n <= 128)
+        return n ? (n - 1) / MALLOC_ALIGN : 0;
+    b = 63 - __builtin_clzl(n - 1);
+    p = (size_t) 1 << b;
+    return 8 + (b - 7) * 4 + (n - p + p / 4 - 1) / (p / 4) - 1;
+}
+
+static inline size_t block_size(unsigned cls) {
+    return sizeof(struct chunk) + class_size(cls);
+}
+
+static inline unsigned cache_limit(unsigned cls) {
+    size_t n = MALLOC_CACHE_BYTES / block_size(cls);
+    return n > MALLOC_CACHE_MAX ? MALLOC_CACHE_MAX : n < MALLOC_CACHE_MIN ? MALLOC_CACHE_MIN : n;
+}
+
+/*
+ * Returns the id of the current ethread, or -1 if it has none yet, e.g. for
+ * allocations made before the scheduler is initialised.
+ */
+static inline int ethread_id(void) {
+    struct lthread_sched *sched = lthread_get_sched();
+    return sched && sched->ethread_id >= 0 ? sched->ethread_id : -1;
+}
+
+static inline struct arena *ethread_arena(void) {
+    int id = ethread_id();
+    return &arenas[id < 0 ? 0 : id % MALLOC_NUM_ARENAS];
+}
+
+/*
+ * Returns the cache of the current ethread, allocating it on first use.
+ * Returns NULL if no cache is available, in which case the arenas are used
+ * directly.
+ */
+static struct tcache *ethread_cache(void) {
+    int id = ethread_id();
+    struct tcache *c;
+
+    if (id < 0 || id >= MALLOC_MAX_ETHREADS)
+        return NULL;
+    if ((c = tcaches[id]))
+        return c;
+
+    c = mmap(0, ROUNDUP(sizeof(*c), PAGE_SIZE), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (c == MAP_FAILED)
+        return NULL;
+
+    // mmap may have yielded and resumed us on another ethread.
+    id = ethread_id();
+    if (id < 0 || id >= MALLOC_MAX_ETHREADS) {
+        munmap(c, ROUNDUP(sizeof(*c), PAGE_SIZE));
+        return NULL;
+    }
+    if (!tcaches[id]) {
+        tcaches[id] = c;
+        return c;
+    }
+    munmap(c, ROUNDUP(sizeof(*c), PAGE_SIZE));
+    return tcaches[id];
+}
+
+/* Pushes the list [first, last] of free blocks of class cls onto arena a. */
+static void arena_push(struct arena *a, unsigned cls, struct free_block *first, struct free_block *last) {
+    ticket_lock(&a->lock);
+    last->next = a->head[cls];
+    a->head[cls] = first;
+    ticket_unlock(&a->lock);
+}
+
+/*
+ * Takes up to n free blocks of class cls from the current ethread's arena,
+ * carving a new span if the arena has none. Returns a NULL-terminated list.
+ * May yield.
+ */
+static struct free_block *arena_fetch(unsigned cls, unsigned n) {
+    struct arena *a = ethread_arena();
+    struct free_block *first, *last, *b;
+    size_t bsize = block_size(cls), span, blocks, i;
+    char *mem;
+
+    ticket_lock(&a->lock);
+    if ((first = a->head[cls])) {
+        for (last = first; --n && last->next; last = last->next);
+        a->head[cls] = last->next;
+        last->next = NULL;
+    }
+    ticket_unlock(&a->lock);
+    if (first)
+        return first;
+
+    blocks = MALLOC_SPAN_SIZE / bsize;
+    if (blocks < MALLOC_SPAN_BLOCKS)
+        blocks = MALLOC_SPAN_BLOCKS;
+    span = ROUNDUP(blocks * bsize, PAGE_SIZE);
+    blocks = span / bsize;
+
+    mem = mmap(0, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+
+    for (i = 0; i < blocks; i++) {
+        b = (struct free_block *) (mem + i * bsize);
+        b->hdr.cls = cls;
+        b->hdr.offset = 0;
+        b->hdr.size = 0;
+        b->next = i + 1 < blocks ? (struct free_block *) (mem + (i + 1) * bsize) : NULL;
+    }
+
+    // Keep n blocks, the rest of the span goes to the arena.
+    if (blocks > n) {
+        last = (struct free_block *) (mem + (n - 1) * bsize);
+        arena_push(ethread_arena(), cls, last->next, (struct free_block *) (mem + (blocks - 1) * bsize));
+        last->next = NULL;
+    }
+    return (struct free_block *) mem;
+}
+
+static void *malloc_small(unsigned cls) {
+    struct tcache *c = ethread_cache();
+    struct free_block *b, *rest, *last;
+
+    if (c && (b = c->head[cls])) {
+        c->head[cls] = b->next;
+        c->count[cls]--;
+        return &b->next;
+    }
+
+    if (!(b = arena_fetch(cls, c ? cache_limit(cls) / 2 : 1))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if ((rest = b->next)) {
+        // arena_fetch may have yielded.
+        if ((c = ethread_cache())) {
+            for (last = rest; last->next; last = last->next)
+                c->count[cls]++;
+            c->count[cls]++;
+            last->next = c->head[cls];
+            c->head[cls] = rest;
+        } else {
+            for (last = rest; last->next; last = last->next);
+            arena_push(ethread_arena(), cls, rest, last);
+        }
+    }
+    return &b->next;
+}
+
+static void free_small(struct free_block *b) {
+    unsigned cls = b->hdr.cls, limit = cache_limit(cls), n;
+    struct tcache *c = ethread_cache();
+    struct free_block *first, *last;
+
+    if (!c) {
+        arena_push(ethread_arena(), cls, b, b);
+        return;
+    }
+
+    b->next = c->head[cls];
+    c->head[cls] = b;
+    if (++c->count[cls] <= limit)
+        return;
+
+    // Return half of the cache to the arena.
+    first = last = c->head[cls];
+    for (n = 1; n < limit / 2; n++)
+        last = last->next;
+    c->head[cls] = last->next;
+    c->count[cls] -= n;
+    arena_push(ethread_arena(), cls, first, last);
+}
+
+/*
+ * Maps a large block of n bytes whose payload is aligned to align. Mappings
+ * are zero-filled.
+ */
+static void *malloc_large(size_t n, size_t align) {
+    size_t offset = align > MALLOC_ALIGN ? align - sizeof(struct chunk) : 0;
+    size_t len;
+    struct chunk *ch;
+    char *mem;
+
+    if (align > UINT32_MAX / 2 || n > SIZE_MAX / 2 - align - PAGE_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    len = ROUNDUP(offset + sizeof(struct chunk) + n + (align > PAGE_SIZE ? align : 0), PAGE_SIZE);
+    mem = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+
+    if (align > PAGE_SIZE)
+        offset = ((uintptr_t) mem + sizeof(struct chunk) + align - 1) / align * align - sizeof(struct chunk) - (uintptr_t) mem;
+    ch = (struct chunk *) (mem + offset);
+    ch->cls = CLASS_LARGE;
+    ch->offset = offset;
+    ch->size = len;
+    return ch + 1;
+}
+
+static inline struct chunk *ptr_to_chunk(void *p) {
+    return (struct chunk *) p - 1;
+}
+
+static size_t chunk_usable_size(struct chunk *ch) {
+    if (ch->cls == CLASS_LARGE)
+        return ch->size - ch->offset - sizeof(struct chunk);
+    return class_size(ch->cls);
+}
+
+void *malloc(size_t n) {
+    if (n <= MALLOC_MAX_SMALL)
+        return malloc_small(size_to_class(n));
+    return malloc_large(n, MALLOC_ALIGN);
+}
+
+void free(void *p) {
+    struct chunk *ch;
+
+    if (!p)
+        return;
+    ch = ptr_to_chunk(p);
+    if (ch->cls == CLASS_LARGE)
+        munmap((char *) ch - ch->offset, ch->size);
+    else
+        free_small((struct free_block *) ch);
+}
+
+void *calloc(size_t m, size_t n) {
+    void *p;
+
+    if (n && m > SIZE_MAX / n) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    n *= m;
+    if (n > MALLOC_MAX_SMALL)
+        return malloc_large(n, MALLOC_ALIGN);
+    if ((p = malloc_small(size_to_class(n))))
+        memset(p, 0, n);
+    return p;
+}
+
+void *realloc(void *p, size_t n) {
+    struct chunk *ch;
+    size_t old, len;
+    void *new;
+
+    if (!p)
+        return malloc(n);
+
+    ch = ptr_to_chunk(p);
+    old = chunk_usable_size(ch);
+    if (ch->cls != CLASS_LARGE) {
+        // Keep the block unless it is much larger than needed.
+        if (n <= old && (n >= old / 2 || old <= 128))
+            return p;
+    } else if (ch->offset == 0 && n > MALLOC_MAX_SMALL) {
+        // enclave_mremap resizes in place where possible.
+        if (n > SIZE_MAX / 2) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        len = ROUNDUP(sizeof(struct chunk) + n, PAGE_SIZE);
+        if (len == ch->size)
+            return p;
+        ch = mremap(ch, ch->size, len, MREMAP_MAYMOVE);
+        if (ch == MAP_FAILED)
+            return NULL;
+        ch->size = len;
+        return ch + 1;
+    }
+
+    if (!(new = malloc(n)))
+        return NULL;
+    memcpy(new, p, n < old ? n : old);
+    free(p);
+    return new;
+}
+
+void *aligned_alloc(size_t align, size_t n) {
+    if ((align & -align) != align) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (align <= MALLOC_ALIGN)
+        return malloc(n);
+
+    // Blocks of size classes are only aligned to MALLOC_ALIGN.
+    return malloc_large(n, align);
+}
+
+int posix_memalign(void **res, size_t align, size_t n) {
+    void *p;
+
+    if (align < sizeof(void *))
+        return EINVAL;
+    if (!(p = aligned_alloc(align, n)))
+        return errno;
+    *res = p;
+    return 0;
+}
+
+void *memalign(size_t align, size_t n) {
+    return aligned_alloc(align, n);
+}
+
+size_t malloc_usable_size(void *p) {
+    return p ? chunk_usable_size(ptr_to_chunk(p)) : 0;
+}
+
+#endif /* SGXLKL_ARENA_MALLOC */
@@ -4,31 +4,69 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #define _GNU_SOURCE
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "bitops.h"
 #include "enclave_mem.h"
+#include "enclave_string.h"
 #include "hostcalls.h"
+#include "lkl/syscall.h"
+#include "queue.h"
 #include "ticketlock.h"
+#include "tree.h"
 #include "sgxlkl_debug.h"
 
 static struct ticketlock mmaplock;
 
 static void* mmap_bitmap;
+static void* mmap_dirty_bitmap; // Pages that may have been written to since they were last zeroed.
+static void* mmap_reserved_bitmap; // Pages mapped PROT_NONE that have not been committed since.
+static unsigned char* mmap_prot; // Protection of each page as last set by mmap or mprotect.
 static void* mmap_base; // First page that can be mmap'ed.
 static void* mmap_end;  // Last page that can be mmap'ed.
 static size_t mmap_num_pages; // Total number of pages that can be mmap'ed.
 
+extern int sgxlkl_mmap_file_support;
+
+static size_t used_pages = 0; // Number of mapped pages.
+static size_t max_used_pages = 0; // Maximum of used_pages thus far.
+static struct enclave_mem_stats mmap_stats; // Event counters, see enclave_mem_get_stats.
+
 #if DEBUG
 extern int sgxlkl_trace_mmap;
-static size_t used_pages = 0; // Tracks the number of used pages for the mmap tracing.
 static size_t mmap_max_allocated = 0; // Maximum amount of memory used thus far.
 #endif /* DEBUG */
 
 #define DIV_ROUNDUP(x, y)   (((x)+((y)-1))/(y))
 
+// Event counters are updated atomically, whether or not mmaplock is held.
+#define STATS_ADD(counter, n) __atomic_fetch_add(&mmap_stats.counter, (n), __ATOMIC_RELAXED)
+#define STATS_GET(counter) __atomic_load_n(&mmap_stats.counter, __ATOMIC_RELAXED)
+
+// Must be called with mmaplock held.
+static inline void used_pages_add(size_t n) {
+    used_pages += n;
+    if (used_pages > max_used_pages)
+        max_used_pages = used_pages;
+}
+
+// Maximum number of pages zeroed by an idle ethread at a time
+#define MMAP_ZERO_IDLE_PAGES 16
+// Maximum number of allocated dirty runs skipped by an idle ethread at a time
+#define MMAP_ZERO_IDLE_SCAN  64
+
+static volatile int mmap_dirty_free; // Set if free pages may be dirty
+static int mmap_exhausted_reported; // Set once heap exhaustion has been reported
+static size_t mmap_zero_cursor; // Bitmap index to continue zeroing from
+
 #define for_each_set_bit_in_region(bit, addr, size, start)   \
         for ((bit) = find_next_bit((addr), (size), (start)); \
              (bit) < (start + nr);                           \
@@ -67,8 +105,218 @@ static inline unsigned long bitmap_find_next_zero_area(unsigned long *map,
     }
 }
 
+/*
+ * Returns the end of the run of bits equal to set that starts at start, at most
+ * end. find_next_bit() and find_next_zero_bit() may return a bit past their
+ * size if it lies in the same word as their offset.
+ */
+static inline unsigned long bitmap_find_run_end(unsigned long *map,
+                                         unsigned long end,
+                                         unsigned long start,
+                                         int set) {
+    unsigned long next = set ? find_next_zero_bit(map, end, start) : find_next_bit(map, end, start);
+    return next < end ? next : end;
+}
+
+/*
+ * Index of free extents (runs of clear bits in the bitmap). Extents are kept in
+ * two trees, one ordered by bitmap index to coalesce and split extents and one
+ * ordered by size to find the smallest extent that fits an allocation in
+ * O(log n). The bitmap remains the authoritative state.
+ *
+ * Extent nodes come from a static pool and are replenished with pages taken
+ * from the smallest free extent. If no node can be allocated (the heap is
+ * exhausted), the index is abandoned and allocations fall back to scanning
+ * the bitmap.
+ */
+struct mmap_extent {
+    RB_ENTRY(mmap_extent) addr_node;
+    RB_ENTRY(mmap_extent) size_node;
+    struct mmap_extent *next_free;
+    size_t index; // First bitmap index of the extent
+    size_t pages;
+};
+
+static inline int mmap_extent_addr_cmp(struct mmap_extent *e1, struct mmap_extent *e2) {
+    if (e1->index < e2->index)
+        return -1;
+    return e1->index > e2->index;
+}
+
+static inline int mmap_extent_size_cmp(struct mmap_extent *e1, struct mmap_extent *e2) {
+    if (e1->pages != e2->pages)
+        return e1->pages < e2->pages ? -1 : 1;
+    return mmap_extent_addr_cmp(e1, e2);
+}
+
+RB_HEAD(mmap_extent_addr, mmap_extent) extents_by_addr = RB_INITIALIZER(&extents_by_addr);
+RB_HEAD(mmap_extent_size, mmap_extent) extents_by_size = RB_INITIALIZER(&extents_by_size);
+RB_GENERATE(mmap_extent_addr, mmap_extent, addr_node, mmap_extent_addr_cmp);
+RB_GENERATE(mmap_extent_size, mmap_extent, size_node, mmap_extent_size_cmp);
+
+#define MMAP_EXTENT_STATIC_NODES 64
+
+static struct mmap_extent extent_static_nodes[MMAP_EXTENT_STATIC_NODES];
+static struct mmap_extent *extent_free_nodes;
+static size_t extent_free_count;
+static int extents_valid;
+
+static void extent_node_put(struct mmap_extent *e) {
+    e->next_free = extent_free_nodes;
+    extent_free_nodes = e;
+    extent_free_count++;
+}
+
+static struct mmap_extent *extent_node_get(void) {
+    struct mmap_extent *e = extent_free_nodes;
+    if (e) {
+        extent_free_nodes = e->next_free;
+        extent_free_count--;
+    }
+    return e;
+}
+
+/* Returns the extent containing index or, if none, the first one after it. */
+static struct mmap_extent *extent_lookup(size_t index) {
+    struct mmap_extent key, *e, *prev;
+
+    key.index = index;
+    e = RB_NFIND(mmap_extent_addr, &extents_by_addr, &key);
+    prev = e ? RB_PREV(mmap_extent_addr, &extents_by_addr, e) :
+               RB_MAX(mmap_extent_addr, &extents_by_addr);
+    if (prev && prev->index + prev->pages >= index)
+        return prev;
+    return e;
+}
+
+/* Removes the pages [start, start + n) from the free extents. */
+static void extent_remove_range(size_t start, size_t n) {
+    struct mmap_extent *e, *next, *right;
+    size_t end = start + n, e_end;
+
+    if (!extents_valid)
+        return;
+
+    for (e = extent_lookup(start); e && e->index < end; e = next) {
+        next = RB_NEXT(mmap_extent_addr, &extents_by_addr, e);
+        e_end = e->index + e->pages;
+        if (e_end <= start)
+            continue;
+        RB_REMOVE(mmap_extent_size, &extents_by_size, e);
+        if (e->index < start && e_end > end) {
+            if (!(right = extent_node_get())) {
+                extents_valid = 0;
+                return;
+            }
+            right->index = end;
+            right->pages = e_end - end;
+            RB_INSERT(mmap_extent_addr, &extents_by_addr, right);
+            RB_INSERT(mmap_extent_size, &extents_by_size, right);
+            e->pages = start - e->index;
+            RB_INSERT(mmap_extent_size, &extents_by_size, e);
+            return;
+        } else if (e->index < start) {
+            e->pages = start - e->index;
+            RB_INSERT(mmap_extent_size, &extents_by_size, e);
+        } else if (e_end > end) {
+            // Does not change the order of e in extents_by_addr.
+            e->index = end;
+            e->pages = e_end - end;
+            RB_INSERT(mmap_extent_size, &extents_by_size, e);
+        } else {
+            RB_REMOVE(mmap_extent_addr, &extents_by_addr, e);
+            extent_node_put(e);
+        }
+    }
+}
+
+/* Adds the pages [start, start + n) to the free extents, coalescing neighbours. */
+static void extent_insert_range(size_t start, size_t n) {
+    struct mmap_extent *e, *next, *node = NULL;
+    size_t lo = start, hi = start + n;
+
+    if (!extents_valid)
+        return;
+
+    for (e = extent_lookup(start); e && e->index <= hi; e = next) {
+        next = RB_NEXT(mmap_extent_addr, &extents_by_addr, e);
+        if (e->index < lo)
+            lo = e->index;
+        if (e->index + e->pages > hi)
+            hi = e->index + e->pages;
+        RB_REMOVE(mmap_extent_addr, &extents_by_addr, e);
+        RB_REMOVE(mmap_extent_size, &extents_by_size, e);
+        if (node)
+            extent_node_put(e);
+        else
+            node = e;
+    }
+
+    if (!node && !(node = extent_node_get())) {
+        extents_valid = 0;
+        return;
+    }
+    node->index = lo;
+    node->pages = hi - lo;
+    RB_INSERT(mmap_extent_addr, &extents_by_addr, node);
+    RB_INSERT(mmap_extent_size, &extents_by_size, node);
+}
+
+/*
+ * Returns the first index for n pages in the smallest free extent that fits.
+ * The pages are taken from the low address end of the extent, which leaves
+ * the free pages above the new mapping so that it can grow in place.
+ */
+static size_t extent_find(size_t n) {
+    struct mmap_extent key, *e;
+
+    key.pages = n;
+    key.index = 0;
+    e = RB_NFIND(mmap_extent_size, &extents_by_size, &key);
+    return e ? e->index + e->pages - n : mmap_num_pages;
+}
+
+static void* index_to_addr(size_t index);
+
+/*
+ * Makes sure that at least two nodes are available, which is the most a
+ * single mmap or munmap needs. Must be called with mmaplock held and before
+ * the caller inspects the bitmaps: free pages keep the protection of their
+ * last mapping, and mmaplock is dropped while a page for new nodes is made
+ * writable, as the host call may yield the calling lthread.
+ */
+static void extent_pool_refill(void) {
+    struct mmap_extent *e, *nodes;
+    size_t i, index;
+    int ret;
+
+    while (extents_valid && extent_free_count < 2) {
+        if (!(e = RB_MIN(mmap_extent_size, &extents_by_size)))
+            return;
+        index = e->index;
+        bitmap_set(mmap_bitmap, index, 1);
+        extent_remove_range(index, 1);
+        used_pages_add(1);
+        ticket_unlock(&mmaplock);
+
+        nodes = index_to_addr(index);
+        ret = host_syscall_SYS_mprotect_raw(nodes, PAGE_SIZE, PROT_READ | PROT_WRITE);
+
+        ticket_lock(&mmaplock);
+        if (ret) {
+            bitmap_clear(mmap_bitmap, index, 1);
+            extent_insert_range(index, 1);
+            used_pages--;
+            return;
+        }
+        mmap_prot[index] = PROT_READ | PROT_WRITE;
+        for (i = 0; i < PAGE_SIZE / sizeof(*nodes); i++)
+            extent_node_put(&nodes[i]);
+    }
+}
+
 static int in_mmap_range(void* addr, size_t size) {
-    return addr >= mmap_base && (addr + size) <= mmap_end;
+    return addr >= mmap_base && (addr + size) <= mmap_end + PAGE_SIZE;
 }
 
 static void* index_to_addr(size_t index) {
@@ -79,6 +327,510 @@ static size_t addr_to_index(void* addr) {
     return (mmap_end - addr) / PAGE_SIZE;
 }
 
+static inline int page_bit(void* map, size_t index) {
+    return (((unsigned long*) map)[BIT_WORD(index)] >> (index % BITS_PER_LONG)) & 1;
+}
+
+/*
+ * Marks the pages [start, start + n) dirty, except for reserved pages which
+ * cannot have been written to. Must be called with mmaplock held.
+ */
+static void mark_dirty_unreserved(size_t start, size_t n) {
+    size_t end = start + n, reserved;
+
+    while (start < end) {
+        reserved = bitmap_find_run_end(mmap_reserved_bitmap, end, start, 0);
+        if (reserved > start)
+            bitmap_set(mmap_dirty_bitmap, start, reserved - start);
+        start = bitmap_find_run_end(mmap_reserved_bitmap, end, reserved, 1);
+    }
+}
+
+/*
+ * Sets the protection of the pages [addr, addr + length) and records it so that
+ * mremap can apply it to the pages it adds to a mapping. Pages that are only
+ * made writable temporarily (e.g. to zero them) are protected by the host
+ * directly.
+ */
+static int enclave_mmap_protect(void* addr, size_t length, int prot) {
+    size_t nr = DIV_ROUNDUP(length, PAGE_SIZE);
+    int ret;
+
+    if ((ret = host_syscall_SYS_mprotect_raw(addr, nr * PAGE_SIZE, prot)) == 0)
+        memset(mmap_prot + addr_to_index(addr) - (nr - 1), prot, nr);
+    return ret;
+}
+
+/*
+ * Reservations (PROT_NONE mappings) are neither zeroed nor protected against
+ * reuse of dirty pages until they are committed by mmap or mprotect.
+ */
+static void enclave_mmap_reserve(void* addr, size_t length) {
+    size_t pages = DIV_ROUNDUP(length, PAGE_SIZE);
+    size_t index_top = addr_to_index(addr) - (pages - 1);
+
+    ticket_lock(&mmaplock);
+    bitmap_set(mmap_reserved_bitmap, index_top, pages);
+    ticket_unlock(&mmaplock);
+}
+
+/*
+ * Commits pages of a mapping, zeroing them if necessary. Only pages that may
+ * have been written to since they were last zeroed need to be cleared, which
+ * avoids touching most pages of large mappings. If reserved_only is set, only
+ * pages of reservations are committed, other pages keep their contents.
+ */
+static void enclave_mmap_commit(void* addr, size_t length, int reserved_only) {
+    size_t nr = DIV_ROUNDUP(length, PAGE_SIZE);
+    size_t index_top = addr_to_index(addr) - (nr - 1);
+    size_t bit, zeroed = 0;
+    int writable = 0;
+
+    // The pages are mapped, so their dirty bits can only change under mmaplock
+    // by us.
+    for_each_set_bit_in_region(bit, mmap_dirty_bitmap, mmap_num_pages, index_top) {
+        if (reserved_only && !page_bit(mmap_reserved_bitmap, bit))
+            continue;
+        // Pages keep the protection of their last mapping until the caller
+        // sets the new protection.
+        if (!writable++)
+            host_syscall_SYS_mprotect_raw(addr, nr * PAGE_SIZE, PROT_READ | PROT_WRITE);
+        enclave_memset(index_to_addr(bit), 0, PAGE_SIZE);
+        zeroed++;
+    }
+    if (zeroed)
+        STATS_ADD(zeroed_pages, zeroed);
+
+    ticket_lock(&mmaplock);
+    if (reserved_only) {
+        for_each_set_bit_in_region(bit, mmap_reserved_bitmap, mmap_num_pages, index_top)
+            bitmap_clear(mmap_dirty_bitmap, bit, 1);
+    } else {
+        bitmap_clear(mmap_dirty_bitmap, index_top, nr);
+    }
+    bitmap_clear(mmap_reserved_bitmap, index_top, nr);
+    ticket_unlock(&mmaplock);
+}
+
+/*
+ * Zeroes a few dirty free pages. Called by idle ethreads so that subsequent
+ * mmap calls find zeroed pages. The pages are marked as mapped while they are
+ * zeroed, so that mmaplock does not have to be held meanwhile.
+ */
+void enclave_mmap_zero_idle(void) {
+    size_t dirty, free, end, next, runs = 0;
+    int zeroed;
+
+    if (!mmap_dirty_free || ticket_trylock(&mmaplock) == EBUSY)
+        return;
+    extent_pool_refill();
+
+    // Find the next page that is dirty and free.
+    for (dirty = find_next_bit(mmap_dirty_bitmap, mmap_num_pages, mmap_zero_cursor);
+        dirty < mmap_num_pages;
+        dirty = find_next_bit(mmap_dirty_bitmap, mmap_num_pages, free)) {
+        free = find_next_zero_bit(mmap_bitmap, mmap_num_pages, dirty);
+        if (free == dirty)
+            break;
+        if (++runs >= MMAP_ZERO_IDLE_SCAN) {
+            mmap_zero_cursor = free;
+            goto out;
+        }
+    }
+
+    if (dirty >= mmap_num_pages) {
+        // Clear mmap_dirty_free only after a full pass without dirty free pages.
+        if (mmap_zero_cursor == 0)
+            mmap_dirty_free = 0;
+        mmap_zero_cursor = 0;
+        goto out;
+    }
+
+    end = dirty + MMAP_ZERO_IDLE_PAGES;
+    if ((next = find_next_zero_bit(mmap_dirty_bitmap, mmap_num_pages, dirty)) < end)
+        end = next;
+    if ((next = find_next_bit(mmap_bitmap, mmap_num_pages, dirty)) < end)
+        end = next;
+
+    bitmap_set(mmap_bitmap, dirty, end - dirty);
+    extent_remove_range(dirty, end - dirty);
+    mmap_zero_cursor = end;
+    ticket_unlock(&mmaplock);
+
+    // Indices grow towards lower addresses. Free pages keep the protection
+    // of their last mapping.
+    zeroed = !host_syscall_SYS_mprotect_raw(index_to_addr(end - 1), (end - dirty) * PAGE_SIZE, PROT_READ | PROT_WRITE);
+    if (zeroed)
+        enclave_memset(index_to_addr(end - 1), 0, (end - dirty) * PAGE_SIZE);
+
+    ticket_lock(&mmaplock);
+    extent_pool_refill();
+    bitmap_clear(mmap_bitmap, dirty, end - dirty);
+    extent_insert_range(dirty, end - dirty);
+    if (zeroed) {
+        bitmap_clear(mmap_dirty_bitmap, dirty, end - dirty);
+        STATS_ADD(zeroed_idle_pages, end - dirty);
+    }
+
+out:
+    ticket_unlock(&mmaplock);
+}
+
+/*
+ * File mappings (SGXLKL_MMAP_FILE_SUPPORT). Files on enclave file systems
+ * live in LKL and cannot be mapped by the host. Instead, the file contents
+ * are read into anonymous enclave memory. Shared mappings are kept coherent
+ * with read and write system calls by enclave_mmap_file_io: writable shared
+ * mappings are written back before the mapped range of the file is read, and
+ * written ranges are copied into all shared mappings of the file. Writes
+ * through a mapping reach the file and the other mappings of the same file on
+ * msync and munmap. Other system calls that modify files, such as ftruncate,
+ * do not update mappings.
+ */
+struct file_mapping {
+    SLIST_ENTRY(file_mapping) entries;
+    void *addr;
+    size_t length;
+    int fd; // Duplicate of the mapped LKL file descriptor
+    int writable;
+    off_t offset;
+    unsigned long dev, ino; // Identify the file across file descriptors
+};
+
+static SLIST_HEAD(file_mapping_head, file_mapping) file_mappings = SLIST_HEAD_INITIALIZER(file_mappings);
+// Writeback performs LKL system calls and may yield, so a ticketlock can't be used.
+static pthread_mutex_t file_mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Performs an LKL system call without the coherence checks of
+ * enclave_mmap_file_io, which take file_mappings_lock.
+ */
+static long file_syscall(long no, long a1, long a2, long a3, long a4) {
+    long params[6] = {a1, a2, a3, a4, 0, 0};
+    return lkl_syscall_lkl(no, params);
+}
+
+/*
+ * Reads [offset, offset + length) of fd into addr, which lies within a
+ * mapping whose pages may not be writable.
+ */
+static void file_mapping_fill(void *addr, size_t length, int fd, off_t offset) {
+    void *page = (void *) ((uintptr_t) addr & ~(uintptr_t) (PAGE_SIZE - 1));
+    size_t pages = DIV_ROUNDUP((size_t) (addr + length - page), PAGE_SIZE);
+    size_t start = addr_to_index(page) - (pages - 1), end = start + pages, next;
+    long ret;
+
+    host_syscall_SYS_mprotect_raw(page, pages * PAGE_SIZE, PROT_READ | PROT_WRITE);
+    while (length > 0 && (ret = file_syscall(__lkl__NR_pread64, fd, (long) addr, length, offset)) > 0) {
+        addr += ret;
+        offset += ret;
+        length -= ret;
+    }
+
+    // Indices grow towards lower addresses.
+    for (; start < end; start = next) {
+        for (next = start + 1; next < end && mmap_prot[next] == mmap_prot[start]; next++);
+        host_syscall_SYS_mprotect_raw(index_to_addr(next - 1), (next - start) * PAGE_SIZE, mmap_prot[start]);
+    }
+}
+
+/*
+ * Copies [offset, offset + length) of the file into all shared mappings of the
+ * range except skip. Must be called with file_mappings_lock held.
+ */
+static void file_mappings_refresh(unsigned long dev, unsigned long ino, off_t offset, size_t length,
+                                  struct file_mapping *skip) {
+    struct file_mapping *m;
+    off_t lo, hi;
+
+    SLIST_FOREACH(m, &file_mappings, entries) {
+        if (m == skip || m->dev != dev || m->ino != ino)
+            continue;
+        lo = m->offset > offset ? m->offset : offset;
+        hi = m->offset + (off_t) m->length < offset + (off_t) length ? m->offset + (off_t) m->length : offset + (off_t) length;
+        if (lo < hi)
+            file_mapping_fill(m->addr + (lo - m->offset), hi - lo, m->fd, lo);
+    }
+}
+
+/*
+ * Writes [addr, addr + length) of mapping m back to the file. Must be called
+ * with file_mappings_lock held.
+ */
+static int file_mapping_writeback(struct file_mapping *m, void *addr, size_t length) {
+    struct lkl_stat stat;
+    off_t offset = m->offset + (addr - m->addr), start;
+    long ret;
+
+    if (!m->writable)
+        return 0;
+
+    // Pages beyond the end of the file must not extend it.
+    if ((ret = lkl_sys_fstat(m->fd, &stat)) < 0)
+        return ret;
+    if (offset >= stat.st_size)
+        return 0;
+    if (offset + length > stat.st_size)
+        length = stat.st_size - offset;
+
+    start = offset;
+    while (length > 0) {
+        ret = file_syscall(__lkl__NR_pwrite64, m->fd, (long) addr, length, offset);
+        if (ret <= 0)
+            return ret ? ret : -EIO;
+        addr += ret;
+        offset += ret;
+        length -= ret;
+    }
+    file_mappings_refresh(m->dev, m->ino, start, offset - start, m);
+    return 0;
+}
+
+/* Writes back all shared mappings overlapping [addr, addr + length). */
+static int file_mappings_sync(void *addr, size_t length, int flags) {
+    struct file_mapping *m;
+    void *lo, *hi;
+    int ret = 0, err;
+
+    pthread_mutex_lock(&file_mappings_lock);
+    SLIST_FOREACH(m, &file_mappings, entries) {
+        if (!m->writable || m->addr >= addr + length || m->addr + m->length <= addr)
+            continue;
+        lo = m->addr > addr ? m->addr : addr;
+        hi = m->addr + m->length < addr + length ? m->addr + m->length : addr + length;
+        if ((err = file_mapping_writeback(m, lo, hi - lo)) < 0 ||
+            ((flags & MS_SYNC) && (err = lkl_sys_fdatasync(m->fd)) < 0))
+            ret = err;
+    }
+    pthread_mutex_unlock(&file_mappings_lock);
+
+    return ret;
+}
+
+/*
+ * Writes back and forgets shared mappings overlapping [addr, addr + length).
+ * Mappings that are only partially unmapped are trimmed or split. Returns the
+ * error of the first failed writeback, the mappings are forgotten regardless.
+ */
+static int file_mappings_unmap(void *addr, size_t length) {
+    struct file_mapping *m, *tmp, *split;
+    void *lo, *hi, *m_end;
+    int ret = 0, err;
+
+    pthread_mutex_lock(&file_mappings_lock);
+    SLIST_FOREACH_SAFE(m, &file_mappings, entries, tmp) {
+        m_end = m->addr + m->length;
+        if (m->addr >= addr + length || m_end <= addr)
+            continue;
+        lo = m->addr > addr ? m->addr : addr;
+        hi = m_end < addr + length ? m_end : addr + length;
+        if ((err = file_mapping_writeback(m, lo, hi - lo)) < 0 && !ret)
+            ret = err;
+
+        if (lo == m->addr && hi == m_end) {
+            SLIST_REMOVE(&file_mappings, m, file_mapping, entries);
+            lkl_sys_close(m->fd);
+            free(m);
+        } else if (lo == m->addr) {
+            m->offset += hi - m->addr;
+            m->length = m_end - hi;
+            m->addr = hi;
+        } else if (hi == m_end) {
+            m->length = lo - m->addr;
+        } else if ((split = malloc(sizeof(*split))) != NULL) {
+            *split = *m;
+            split->addr = hi;
+            split->length = m_end - hi;
+            split->offset = m->offset + (hi - m->addr);
+            split->fd = lkl_sys_dup(m->fd);
+            if (split->fd >= 0)
+                SLIST_INSERT_HEAD(&file_mappings, split, entries);
+            else
+                free(split);
+            m->length = lo - m->addr;
+        } else {
+            m->length = lo - m->addr;
+        }
+    }
+    pthread_mutex_unlock(&file_mappings_lock);
+
+    return ret;
+}
+
+/*
+ * Called by lkl_syscall (see src/lkl/syscall.c) for read and write system
+ * calls. While shared file mappings exist, each call costs an additional
+ * fstat to find out whether it accesses a mapped file.
+ */
+long enclave_mmap_file_io(long no, long *params) {
+    struct file_mapping *m;
+    struct lkl_stat stat;
+    struct iovec *iov = (struct iovec *) params[1];
+    int fd = (int) params[0], write = 0, mapped = 0, i;
+    off_t offset = -1, lo, hi;
+    size_t length = 0;
+    long ret;
+
+    if (SLIST_EMPTY(&file_mappings) || lkl_sys_fstat(fd, &stat) < 0 || !S_ISREG(stat.st_mode))
+        return lkl_syscall_lkl(no, params);
+
+    pthread_mutex_lock(&file_mappings_lock);
+    SLIST_FOREACH(m, &file_mappings, entries) {
+        if (m->dev == stat.st_dev && m->ino == stat.st_ino) {
+            mapped = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&file_mappings_lock);
+    if (!mapped)
+        return lkl_syscall_lkl(no, params);
+
+    switch (no) {
+        case __lkl__NR_write:
+        case __lkl__NR_writev:
+        case __lkl__NR_pwrite64:
+        case __lkl__NR_pwritev:
+            write = 1;
+            break;
+    }
+    switch (no) {
+        case __lkl__NR_pread64:
+        case __lkl__NR_pwrite64:
+            offset = params[3];
+            // fall through
+        case __lkl__NR_read:
+        case __lkl__NR_write:
+            length = params[2];
+            break;
+        case __lkl__NR_preadv:
+        case __lkl__NR_pwritev:
+            offset = params[3];
+            // fall through
+        default:
+            for (i = 0; i < (int) params[2]; i++)
+                length += iov[i].iov_len;
+            break;
+    }
+
+    // Mapped writes to the range must be visible to the read.
+    if (!write) {
+        if (offset < 0 && (offset = file_syscall(__lkl__NR_lseek, fd, 0, SEEK_CUR, 0)) < 0)
+            return lkl_syscall_lkl(no, params);
+        pthread_mutex_lock(&file_mappings_lock);
+        SLIST_FOREACH(m, &file_mappings, entries) {
+            if (!m->writable || m->dev != stat.st_dev || m->ino != stat.st_ino)
+                continue;
+            lo = m->offset > offset ? m->offset : offset;
+            hi = m->offset + (off_t) m->length < offset + (off_t) length ? m->offset + (off_t) m->length : offset + (off_t) length;
+            if (lo < hi)
+                file_mapping_writeback(m, m->addr + (lo - m->offset), hi - lo);
+        }
+        pthread_mutex_unlock(&file_mappings_lock);
+        return lkl_syscall_lkl(no, params);
+    }
+
+    ret = lkl_syscall_lkl(no, params);
+    if (ret <= 0)
+        return ret;
+    // write and writev may append, so the offset is only known afterwards.
+    if (offset < 0 && (offset = file_syscall(__lkl__NR_lseek, fd, 0, SEEK_CUR, 0) - ret) < 0)
+        return ret;
+    pthread_mutex_lock(&file_mappings_lock);
+    file_mappings_refresh(stat.st_dev, stat.st_ino, offset, ret, NULL);
+    pthread_mutex_unlock(&file_mappings_lock);
+    return ret;
+}
+
+/* Returns 1 if a shared mapping overlaps [addr, addr + length). */
+static int file_mappings_overlap(void *addr, size_t length) {
+    struct file_mapping *m;
+    int ret = 0;
+
+    pthread_mutex_lock(&file_mappings_lock);
+    SLIST_FOREACH(m, &file_mappings, entries) {
+        if (m->addr < addr + length && m->addr + m->length > addr) {
+            ret = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&file_mappings_lock);
+
+    return ret;
+}
+
+static void *enclave_mmap_file(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    struct file_mapping *m = NULL;
+    struct lkl_stat stat;
+    size_t done = 0;
+    long ret;
+    void *mem;
+
+    if (offset % PAGE_SIZE != 0 || length == 0) {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+
+    if (flags & MAP_SHARED) {
+        if ((m = malloc(sizeof(*m))) == NULL) {
+            errno = ENOMEM;
+            return MAP_FAILED;
+        }
+        if ((ret = lkl_sys_fstat(fd, &stat)) < 0) {
+            errno = -ret;
+            free(m);
+            return MAP_FAILED;
+        }
+        m->dev = stat.st_dev;
+        m->ino = stat.st_ino;
+        m->writable = (prot & PROT_WRITE) != 0;
+        // The application may close fd while the mapping exists.
+        if ((m->fd = lkl_sys_dup(fd)) < 0) {
+            errno = -m->fd;
+            free(m);
+            return MAP_FAILED;
+        }
+    }
+
+    mem = enclave_mmap(addr, length, flags & MAP_FIXED);
+    if (mem == MAP_FAILED)
+        goto err;
+    enclave_mmap_commit(mem, length, 0);
+    enclave_mmap_protect(mem, length, PROT_READ | PROT_WRITE);
+
+    // Pages beyond the end of the file remain zero.
+    while (done < length) {
+        ret = file_syscall(__lkl__NR_pread64, fd, (long) (mem + done), length - done, offset + done);
+        if (ret < 0) {
+            enclave_munmap(mem, length);
+            errno = -ret;
+            goto err;
+        }
+        if (ret == 0)
+            break;
+        done += ret;
+    }
+    enclave_mmap_protect(mem, length, prot);
+
+    if (m) {
+        m->addr = mem;
+        m->length = DIV_ROUNDUP(length, PAGE_SIZE) * PAGE_SIZE;
+        m->offset = offset;
+        pthread_mutex_lock(&file_mappings_lock);
+        SLIST_INSERT_HEAD(&file_mappings, m, entries);
+        pthread_mutex_unlock(&file_mappings_lock);
+    }
+
+    SGXLKL_TRACE_MMAP("mmap file: fd = %d, offset = %ld, length = %zu, read = %zu (ret = %p)%s\n", fd, (long) offset, length, done, mem, m ? " (MAP_SHARED)" : "");
+    return mem;
+
+err:
+    if (m) {
+        lkl_sys_close(m->fd);
+        free(m);
+    }
+    return MAP_FAILED;
+}
+
 void *syscall_SYS_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
     void *mem;
     if ((flags & MAP_SHARED) && (flags & MAP_PRIVATE)) {
@@ -87,12 +839,16 @@ void *syscall_SYS_mmap(void *addr, size_t length, int prot, int flags, int fd, o
     }
     if (flags & MAP_ANON) {
         mem = enclave_mmap(addr, length, flags & MAP_FIXED);
-        mprotect(mem, length , prot);
         if (mem == MAP_FAILED) {
             return mem;
         }
-        if(prot & PROT_WRITE)
-            memset(mem, 0, length);
+        if (prot == PROT_NONE)
+            enclave_mmap_reserve(mem, length);
+        else
+            enclave_mmap_commit(mem, length, 0);
+        enclave_mmap_protect(mem, length, prot);
+    } else if (sgxlkl_mmap_file_support) {
+        mem = enclave_mmap_file(addr, length, prot, flags, fd, offset);
     } else {
         //TODO: Do not allocate memory outside enclave for a system call that
         //can be invoked by applications!
@@ -101,27 +857,122 @@ void *syscall_SYS_mmap(void *addr, size_t length, int prot, int flags, int fd, o
     return mem;
 }
 
+/*
+ * Shared file mappings can be shrunk, the removed pages are written back. They
+ * cannot be grown as the added pages would not be backed by the file.
+ */
 void *syscall_SYS_mremap(void *old_addr, size_t old_length, size_t new_length, int flags, void *new_addr) {
+    size_t old_pages = DIV_ROUNDUP(old_length, PAGE_SIZE);
+    size_t new_pages = DIV_ROUNDUP(new_length, PAGE_SIZE);
+
     if (!in_mmap_range(old_addr, 0)) {
         return host_syscall_SYS_mremap(old_addr, old_length, new_length, flags, new_addr);
     }
-    return enclave_mremap(old_addr, old_length, new_addr, new_length, flags & MREMAP_FIXED);
+    if (!SLIST_EMPTY(&file_mappings) && (uintptr_t) old_addr % PAGE_SIZE == 0 && new_pages != old_pages &&
+        new_pages > 0 && file_mappings_overlap(old_addr, old_pages * PAGE_SIZE)) {
+        if (new_pages > old_pages) {
+            errno = EINVAL;
+            return MAP_FAILED;
+        }
+        file_mappings_unmap(old_addr + new_pages * PAGE_SIZE, (old_pages - new_pages) * PAGE_SIZE);
+    }
+    return enclave_mremap(old_addr, old_length, new_addr, new_length, flags & MREMAP_FIXED, flags & MREMAP_MAYMOVE);
 }
 
 int syscall_SYS_munmap(void *addr, size_t length) {
     if (in_mmap_range(addr, 0)) {
+        int ret = 0;
+        if (!SLIST_EMPTY(&file_mappings))
+            ret = file_mappings_unmap(addr, length);
         enclave_munmap(addr, length);
-        return 0;
+        return ret;
     } else {
         return host_syscall_SYS_munmap(addr, length);
     }
 }
 
+int syscall_SYS_mprotect(void *addr, size_t length, int prot) {
+    if (length == 0 || (uintptr_t) addr % PAGE_SIZE != 0 || !in_mmap_range(addr, length))
+        return host_syscall_SYS_mprotect_raw(addr, length, prot);
+    if (prot != PROT_NONE)
+        enclave_mmap_commit(addr, length, 1);
+    return enclave_mmap_protect(addr, length, prot);
+}
+
+#ifndef MADV_FREE
+#define MADV_FREE 8
+#endif
+
+/*
+ * madvise for enclave memory range.
+ *
+ * MADV_DONTNEED must leave zero pages behind. In simulation mode, the enclave
+ * heap is anonymous host memory and the host discards the pages. In hardware
+ * mode, enclave pages cannot be discarded and are zeroed directly, which is
+ * still cheaper than munmap/mmap. Reserved pages are zeroed on commit and
+ * non-writable pages cannot be zeroed, both are skipped. MADV_FREE allows the
+ * contents to be kept and is only passed on to the host in simulation mode.
+ * All other advice is ignored.
+ */
+int syscall_SYS_madvise(void *addr, size_t length, int advice) {
+    if (!in_mmap_range(addr, 0)) {
+        return host_syscall_SYS_madvise(addr, length, advice);
+    }
+
+    if ((uintptr_t) addr % PAGE_SIZE != 0 || !in_mmap_range(addr, length)) {
+        return -EINVAL;
+    }
+    length = DIV_ROUNDUP(length, PAGE_SIZE) * PAGE_SIZE;
+
+    switch (advice) {
+        case MADV_DONTNEED:
+#ifndef SGXLKL_HW
+            return host_syscall_SYS_madvise(addr, length, MADV_DONTNEED);
+#else
+            {
+                size_t start = addr_to_index(addr) - (length / PAGE_SIZE - 1);
+                size_t end = start + length / PAGE_SIZE, reserved, run;
+                // Pages are zeroed without holding mmaplock.
+                ticket_lock(&mmaplock);
+                while (start < end) {
+                    if (page_bit(mmap_reserved_bitmap, start)) {
+                        start = bitmap_find_run_end(mmap_reserved_bitmap, end, start, 1);
+                        continue;
+                    }
+                    if (!(mmap_prot[start] & PROT_WRITE)) {
+                        start++;
+                        continue;
+                    }
+                    reserved = bitmap_find_run_end(mmap_reserved_bitmap, end, start, 0);
+                    for (run = start + 1; run < reserved && (mmap_prot[run] & PROT_WRITE); run++);
+                    ticket_unlock(&mmaplock);
+                    enclave_memset(index_to_addr(run - 1), 0, (run - start) * PAGE_SIZE);
+                    STATS_ADD(zeroed_pages, run - start);
+                    ticket_lock(&mmaplock);
+                    start = run;
+                }
+                ticket_unlock(&mmaplock);
+            }
+            return 0;
+#endif
+        case MADV_FREE:
+#ifndef SGXLKL_HW
+            return host_syscall_SYS_madvise(addr, length, MADV_FREE);
+#else
+            return 0;
+#endif
+        default:
+            return 0;
+    }
+}
+
 int syscall_SYS_msync(void *addr, size_t length, int flags) {
     if (!in_mmap_range(addr, 0)) {
         return host_syscall_SYS_msync(addr, length, flags);
     }
 
+    if (!SLIST_EMPTY(&file_mappings))
+        return file_mappings_sync(addr, length, flags);
     return 0;
 }
 
@@ -132,8 +983,11 @@ int syscall_SYS_msync(void *addr, size_t length, int flags) {
  * enumber of pages starting at the base address to manage.
  * 
  * A bitmap is used to keep track of mapped/unmapped pages in the range of base
- * to base + num_pages*PAGE_SIZE. The bitmap occupies the first few pages of
- * enclave memory.
+ * to base + num_pages*PAGE_SIZE. A second bitmap tracks pages that may have
+ * been written to since they were last zeroed and a third one tracks
+ * uncommitted reservations (see enclave_mmap_reserve). Enclave memory is zero
+ * initially. The protection of each page is kept in a byte array.
+ * The bitmaps and the array occupy the first few pages of enclave memory.
  */
 void enclave_mman_init(void* base, size_t num_pages) {
     // Don't use page at address 0x0.
@@ -142,16 +996,47 @@ void enclave_mman_init(void* base, size_t num_pages) {
         num_pages = num_pages - 1;
     }
 
-    // Determine required size (in pages) for the bitmap.
+    // Determine required size (in pages) for the bitmaps and the protection array.
     size_t bitmap_req_pages = DIV_ROUNDUP(num_pages, BITS_PER_BYTE * PAGE_SIZE);
-    mmap_num_pages = num_pages - bitmap_req_pages;
-    // Bitmap is stored at the beginning of the enclave memory range.
+    size_t prot_req_pages = DIV_ROUNDUP(num_pages, PAGE_SIZE);
+    mmap_num_pages = num_pages - 3 * bitmap_req_pages - prot_req_pages;
+    // Bitmaps are stored at the beginning of the enclave memory range.
     mmap_bitmap = base;
+    mmap_dirty_bitmap = mmap_bitmap + (bitmap_req_pages * PAGE_SIZE);
+    mmap_reserved_bitmap = mmap_dirty_bitmap + (bitmap_req_pages * PAGE_SIZE);
+    mmap_prot = mmap_reserved_bitmap + (bitmap_req_pages * PAGE_SIZE);
     // Base address for range of pages available to mmap calls.
-    mmap_base = mmap_bitmap + (bitmap_req_pages * PAGE_SIZE);
+    mmap_base = (void*) mmap_prot + (prot_req_pages * PAGE_SIZE);
     mmap_end = mmap_base + (mmap_num_pages - 1) * PAGE_SIZE;
-    // Initialize bitmap
+    // Initialize bitmaps
     bitmap_clear(mmap_bitmap, 0, mmap_num_pages);
+    bitmap_clear(mmap_dirty_bitmap, 0, mmap_num_pages);
+    bitmap_clear(mmap_reserved_bitmap, 0, mmap_num_pages);
+    memset(mmap_prot, PROT_NONE, mmap_num_pages);
+
+    // Initialize extent index with a single free extent
+    for (size_t i = 0; i < MMAP_EXTENT_STATIC_NODES; i++)
+        extent_node_put(&extent_static_nodes[i]);
+    extents_valid = 1;
+    extent_insert_range(0, mmap_num_pages);
+}
+
+/*
+ * Reports the first allocation that fails because the enclave heap is
+ * exhausted. Applications often do not report ENOMEM from mmap or malloc
+ * meaningfully.
+ */
+static void enclave_mmap_report_exhausted(size_t length) {
+    char buf[256];
+    int n;
+
+    if (__atomic_exchange_n(&mmap_exhausted_reported, 1, __ATOMIC_RELAXED))
+        return;
+
+    n = snprintf(buf, sizeof(buf), "[    SGX-LKL   ] Warning: Enclave heap exhausted, mmap of %zu KB failed (heap size: %zu KB). Increase SGXLKL_HEAP.\n",
+        length / 1024, mmap_num_pages * PAGE_SIZE / 1024);
+    if (n > 0)
+        host_syscall_SYS_write(STDERR_FILENO, buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
 }
 
 /*
@@ -161,6 +1046,7 @@ void* enclave_mmap(void* addr, size_t length, int mmap_fixed) {
     void* ret = 0;
     size_t pages = DIV_ROUNDUP(length, PAGE_SIZE);
     size_t replaced_pages = 0;
+    int exhausted = 0;
 
     // Make sure addr is page aligned and size is greater than 0.
     if((uintptr_t) addr % PAGE_SIZE != 0 || length == 0) {
@@ -169,6 +1055,7 @@ void* enclave_mmap(void* addr, size_t length, int mmap_fixed) {
     }
 
     ticket_lock(&mmaplock);
+    extent_pool_refill();
     if(mmap_fixed) {
         if(!in_mmap_range(addr, length)) {
             errno = ENOMEM;
@@ -177,12 +1064,19 @@ void* enclave_mmap(void* addr, size_t length, int mmap_fixed) {
             // Get index for last page since the bitmap is used in reverse.
             size_t index_top = addr_to_index(addr) - (pages - 1);
 
-#if DEBUG
-            if(sgxlkl_trace_mmap)
-                replaced_pages = bitmap_count_set_bits(mmap_bitmap, mmap_num_pages, index_top, pages);
-#endif /* DEBUG */
+            replaced_pages = bitmap_count_set_bits(mmap_bitmap, mmap_num_pages, index_top, pages);
+
+            // Replaced pages have to be zeroed again.
+            size_t start = index_top, end = index_top + pages, next;
+            while ((start = find_next_bit(mmap_bitmap, end, start)) < end) {
+                next = find_next_zero_bit(mmap_bitmap, end, start);
+                mark_dirty_unreserved(start, next - start);
+                start = next;
+            }
+            bitmap_clear(mmap_reserved_bitmap, index_top, pages);
 
             bitmap_set(mmap_bitmap, index_top, pages);
+            extent_remove_range(index_top, pages);
             ret = addr;
         }
     } else if(addr != 0 && in_mmap_range(addr, length)) {
@@ -191,31 +1085,43 @@ void* enclave_mmap(void* addr, size_t length, int mmap_fixed) {
         // Address provided as a hint, check if range is available.
         if(!bitmap_count_set_bits(mmap_bitmap, mmap_num_pages, index_top, pages)) {
             bitmap_set(mmap_bitmap, index_top, pages);
+            extent_remove_range(index_top, pages);
             ret = addr;
         }
     }
 
     // Find next area with enough space.
     if(ret == 0) {
-        size_t index_top = bitmap_find_next_zero_area(mmap_bitmap, mmap_num_pages, 0, pages);
+        size_t index_top;
+        if (extents_valid)
+            index_top = extent_find(pages);
+        else
+            index_top = bitmap_find_next_zero_area(mmap_bitmap, mmap_num_pages, 0, pages);
         if(index_top + pages  > mmap_num_pages) {
             errno = ENOMEM;
             ret = MAP_FAILED;
+            exhausted = 1;
         } else {
             bitmap_set(mmap_bitmap, index_top, pages);
+            extent_remove_range(index_top, pages);
             size_t index = index_top + (pages - 1);
             ret = index_to_addr(index);
         }
     }
 
+    if (ret != MAP_FAILED) {
+        used_pages_add(pages - replaced_pages);
+        STATS_ADD(mmaps, 1);
+    } else {
+        STATS_ADD(mmap_failures, 1);
+    }
     ticket_unlock(&mmaplock);
 
+    if (exhausted)
+        enclave_mmap_report_exhausted(pages * PAGE_SIZE);
+
 #if DEBUG
     if(sgxlkl_trace_mmap) {
-        if (ret != MAP_FAILED) {
-            used_pages += pages - replaced_pages;
-        }
-
         size_t requested = pages * PAGESIZE;
         size_t total = mmap_num_pages * PAGESIZE;
         size_t free = (mmap_num_pages - used_pages) * PAGESIZE;
@@ -248,14 +1154,17 @@ int enclave_munmap(void* addr, size_t length) {
     size_t index_top = index - (pages - 1);
 
     ticket_lock(&mmaplock);
+    extent_pool_refill();
 
-#if DEBUG
     // Only count pages that have been marked as mmapped before.
-    size_t occupied_pages = bitmap_count_set_bits(mmap_bitmap, mmap_num_pages, index_top, pages);
-    used_pages -= occupied_pages;
-#endif /* DEBUG */
+    used_pages -= bitmap_count_set_bits(mmap_bitmap, mmap_num_pages, index_top, pages);
+    STATS_ADD(munmaps, 1);
 
     bitmap_clear(mmap_bitmap, index_top, pages);
+    extent_insert_range(index_top, pages);
+    mark_dirty_unreserved(index_top, pages);
+    bitmap_clear(mmap_reserved_bitmap, index_top, pages);
+    mmap_dirty_free = 1;
     ticket_unlock(&mmaplock);
 
 #if DEBUG
@@ -271,22 +1180,170 @@ int enclave_munmap(void* addr, size_t length) {
     return 0;
 }
 
+/*
+ * Grows the mapping at addr from old_pages to new_pages without moving it if
+ * the pages following it are free. Returns 0 on success.
+ */
+static int enclave_mremap_grow(void* addr, size_t old_pages, size_t new_pages) {
+    size_t grow = new_pages - old_pages;
+    int ret = -1;
+
+    if(!in_mmap_range(addr, new_pages * PAGE_SIZE))
+        return -1;
+
+    // Higher addresses have lower indices as the bitmap is used in reverse.
+    size_t index_top = addr_to_index(addr) - (old_pages - 1) - grow;
+
+    ticket_lock(&mmaplock);
+    extent_pool_refill();
+    if(!bitmap_count_set_bits(mmap_bitmap, mmap_num_pages, index_top, grow)) {
+        bitmap_set(mmap_bitmap, index_top, grow);
+        extent_remove_range(index_top, grow);
+        used_pages_add(grow);
+        ret = 0;
+    }
+    ticket_unlock(&mmaplock);
+
+    return ret;
+}
+
+/*
+ * Adds the pages [addr, addr + length) to a mapping with protection prot.
+ * They are committed, or reserved if the mapping is inaccessible.
+ */
+static void enclave_mremap_extend(void* addr, size_t length, int prot) {
+    if (prot == PROT_NONE)
+        enclave_mmap_reserve(addr, length);
+    else
+        enclave_mmap_commit(addr, length, 0);
+    enclave_mmap_protect(addr, length, prot);
+}
+
+/*
+ * Moves the pages of the mapping at src to the new mapping at dst, keeping
+ * their contents, protection and reservations. Reserved pages are not
+ * copied, they are zeroed once committed.
+ */
+static void enclave_mremap_move(void* dst, void* src, size_t pages) {
+    size_t src_top = addr_to_index(src) - (pages - 1);
+    size_t dst_top = addr_to_index(dst) - (pages - 1);
+    size_t src_end = src_top + pages, start, end;
+    int reserved;
+
+    // Indices grow towards lower addresses.
+    host_syscall_SYS_mprotect_raw(dst, pages * PAGE_SIZE, PROT_READ | PROT_WRITE);
+    for (start = src_top; start < src_end; start++) {
+        if (!(mmap_prot[start] & PROT_READ)) {
+            host_syscall_SYS_mprotect_raw(src, pages * PAGE_SIZE, PROT_READ);
+            break;
+        }
+    }
+
+    for (start = src_top; start < src_end; start = end) {
+        reserved = page_bit(mmap_reserved_bitmap, start);
+        end = bitmap_find_run_end(mmap_reserved_bitmap, src_end, start, reserved);
+        if (reserved) {
+            ticket_lock(&mmaplock);
+            bitmap_set(mmap_reserved_bitmap, dst_top + (start - src_top), end - start);
+            ticket_unlock(&mmaplock);
+        } else {
+            enclave_memcpy(index_to_addr(dst_top + (end - src_top) - 1), index_to_addr(end - 1), (end - start) * PAGE_SIZE);
+        }
+    }
+
+    for (start = src_top; start < src_end; start = end) {
+        for (end = start + 1; end < src_end && mmap_prot[end] == mmap_prot[start]; end++);
+        enclave_mmap_protect(index_to_addr(dst_top + (end - src_top) - 1), (end - start) * PAGE_SIZE, mmap_prot[start]);
+    }
+}
+
 /*
  * mremap for enclave memory range.
+ *
+ * Mappings are shrunk in place and grown in place if possible. Otherwise, if
+ * mremap_maymove is set, a new range is mapped and the contents are copied.
+ * Pages added to a mapping get the protection of its last page.
  */
-void* enclave_mremap(void* old_addr, size_t old_length, void* new_addr, size_t new_length, int mremap_fixed) {
-    // TODO: If possible, extend region without copying memory
+void* enclave_mremap(void* old_addr, size_t old_length, void* new_addr, size_t new_length, int mremap_fixed, int mremap_maymove) {
+    size_t old_pages = DIV_ROUNDUP(old_length, PAGE_SIZE);
+    size_t new_pages = DIV_ROUNDUP(new_length, PAGE_SIZE);
+    int prot;
+
     // TODO: Support for MREMAP_FIXED
-    if(mremap_fixed) {
+    if(mremap_fixed || (uintptr_t) old_addr % PAGE_SIZE != 0 || old_length == 0 || new_length == 0) {
         errno = EINVAL;
         return MAP_FAILED;
     }
 
+    if(new_pages <= old_pages) {
+        if(new_pages < old_pages)
+            enclave_munmap(old_addr + new_pages * PAGE_SIZE, (old_pages - new_pages) * PAGE_SIZE);
+        STATS_ADD(mremaps_in_place, 1);
+        return old_addr;
+    }
+
+    prot = mmap_prot[addr_to_index(old_addr) - (old_pages - 1)];
+
+    if(!enclave_mremap_grow(old_addr, old_pages, new_pages)) {
+        enclave_mremap_extend(old_addr + old_pages * PAGE_SIZE, (new_pages - old_pages) * PAGE_SIZE, prot);
+        STATS_ADD(mremaps_in_place, 1);
+        SGXLKL_TRACE_MMAP("mremap grown in place: %p, %zuKB -> %zuKB\n", old_addr, old_length/1024, new_length/1024);
+        return old_addr;
+    }
+
+    if(!mremap_maymove) {
+        errno = ENOMEM;
+        return MAP_FAILED;
+    }
+
     void *mem = enclave_mmap(new_addr, new_length, 0);
     if (mem != MAP_FAILED) {
-        memcpy(mem, old_addr, old_length > new_length ? new_length : old_length);
+        enclave_mremap_move(mem, old_addr, old_pages);
+        enclave_mremap_extend(mem + old_pages * PAGE_SIZE, (new_pages - old_pages) * PAGE_SIZE, prot);
         enclave_munmap(old_addr, old_length);
+        STATS_ADD(mremaps_copied, 1);
+        STATS_ADD(mremap_copied_bytes, old_length);
     }
 
     return mem;
 }
+
+/*
+ * Returns a snapshot of the enclave memory statistics. Rates can be derived by
+ * sampling the event counters.
+ */
+void enclave_mem_get_stats(struct enclave_mem_stats *stats) {
+    struct mmap_extent *e;
+    size_t start, end;
+
+    stats->mmaps = STATS_GET(mmaps);
+    stats->mmap_failures = STATS_GET(mmap_failures);
+    stats->munmaps = STATS_GET(munmaps);
+    stats->mremaps_in_place = STATS_GET(mremaps_in_place);
+    stats->mremaps_copied = STATS_GET(mremaps_copied);
+    stats->mremap_copied_bytes = STATS_GET(mremap_copied_bytes);
+    stats->zeroed_pages = STATS_GET(zeroed_pages);
+    stats->zeroed_idle_pages = STATS_GET(zeroed_idle_pages);
+
+    ticket_lock(&mmaplock);
+    stats->total_pages = mmap_num_pages;
+    stats->used_pages = used_pages;
+    stats->max_used_pages = max_used_pages;
+    stats->free_extents = 0;
+    stats->largest_free_extent = 0;
+    if (extents_valid) {
+        RB_FOREACH(e, mmap_extent_addr, &extents_by_addr)
+            stats->free_extents++;
+        if ((e = RB_MAX(mmap_extent_size, &extents_by_size)))
+            stats->largest_free_extent = e->pages;
+    } else {
+        for (start = find_next_zero_bit(mmap_bitmap, mmap_num_pages, 0); start < mmap_num_pages;
+             start = find_next_zero_bit(mmap_bitmap, mmap_num_pages, end)) {
+            end = find_next_bit(mmap_bitmap, mmap_num_pages, start);
+            stats->free_extents++;
+            if (end - start > stats->largest_free_extent)
+                stats->largest_free_extent = end - start;
+        }
+    }
+    ticket_unlock(&mmaplock);
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2016, 2017, 2018 Imperial College London
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "enclave_config.h"
+#include "enclave_string.h"
+
+static int enclave_erms; // Enhanced rep movsb/stosb available
+
+/*
+ * CPUID cannot be executed inside an enclave, so CPU features are detected
+ * by sgx-lkl-run and passed in the enclave configuration.
+ */
+void enclave_string_init(uint32_t cpu_features) {
+    enclave_erms = !!(cpu_features & SGXLKL_CPU_ERMS);
+}
+
+void *enclave_memcpy_rep(void *dst, const void *src, size_t n) {
+    void *ret = dst;
+
+    if (!enclave_erms)
+        return memcpy(dst, src, n);
+
+    __asm__ __volatile__ ("rep movsb"
+            : "+D" (dst), "+S" (src), "+c" (n)
+            :
+            : "memory");
+    return ret;
+}
+
+void *enclave_memset_rep(void *dst, int c, size_t n) {
+    void *ret = dst;
+
+    if (!enclave_erms)
+        return memset(dst, c, n);
+
+    __asm__ __volatile__ ("rep stosb"
+            : "+D" (dst), "+c" (n)
+            : "a" (c)
+            : "memory");
+    return ret;
+}
+
+/*
+ * Copies with SSE2 non-temporal stores. SSE2 is part of x86-64 and always
+ * enabled for enclaves, unlike AVX which depends on the enclave's XFRM.
+ */
+void *enclave_memcpy_nt(void *dst, const void *src, size_t n) {
+    char *d = dst;
+    const char *s = src;
+    size_t head = -(uintptr_t) d & 15;
+
+    // movntdq requires 16-byte aligned destinations.
+    if (head) {
+        if (head > n)
+            head = n;
+        memcpy(d, s, head);
+        d += head;
+        s += head;
+        n -= head;
+    }
+
+    for (; n >= 64; n -= 64, d += 64, s += 64) {
+        __asm__ __volatile__ (
+                "movdqu    (%1), %%xmm0\n\t"
+                "movdqu  16(%1), %%xmm1\n\t"
+                "movdqu  32(%1), %%xmm2\n\t"
+                "movdqu  48(%1), %%xmm3\n\t"
+                "movntdq %%xmm0,   (%0)\n\t"
+                "movntdq %%xmm1, 16(%0)\n\t"
+                "movntdq %%xmm2, 32(%0)\n\t"
+                "movntdq %%xmm3, 48(%0)\n\t"
+                :
+                : "r" (d), "r" (s)
+                : "memory", "xmm0", "xmm1", "xmm2", "xmm3");
+    }
+    // Order the non-temporal stores before the host is notified.
+    __asm__ __volatile__ ("sfence" ::: "memory");
+
+    if (n)
+        memcpy(d, s, n);
+    return dst;
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright 2016, 2017, 2018 Imperial College London
+ */
+
+/*
+ * Builds src/sgx/enclave_mem.c on the host for unit tests. The enclave mmap
+ * range is taken from the host heap, host calls go to the host directly and
+ * LKL file system calls to host files.
+ */
+
+#ifndef ENCLAVE_MEM_TEST_H
+#define ENCLAVE_MEM_TEST_H
+
+#include "pthread_impl.h"
+
+#include <assert.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// bitops.h defines its own ffs and ffsl.
+#define ffs bitops_ffs
+#define ffsl bitops_ffsl
+#include "../src/sgx/enclave_mem.c"
+#include "../src/sgx/enclave_string.c"
+#undef ffs
+#undef ffsl
+
+int sgxlkl_mmap_file_support;
+
+/* Host calls may yield the calling lthread, so mmaplock must not be held. */
+#define assert_mmaplock_free() assert(mmaplock.s.ticket == mmaplock.s.users)
+
+void *host_syscall_SYS_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    assert_mmaplock_free();
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+void *host_syscall_SYS_mremap(void *old_address, size_t old_size, size_t new_size, int flags, void *new_address) {
+    assert_mmaplock_free();
+    return mremap(old_address, old_size, new_size, flags, new_address);
+}
+
+int host_syscall_SYS_munmap(void *addr, size_t length) {
+    assert_mmaplock_free();
+    return munmap(addr, length) ? -errno : 0;
+}
+
+int host_syscall_SYS_msync(void *addr, size_t length, int flags) {
+    assert_mmaplock_free();
+    return msync(addr, length, flags) ? -errno : 0;
+}
+
+int host_syscall_SYS_mprotect_raw(void *addr, size_t len, int prot) {
+    assert_mmaplock_free();
+    return mprotect(addr, len, prot) ? -errno : 0;
+}
+
+int host_syscall_SYS_madvise(void *addr, size_t length, int advice) {
+    assert_mmaplock_free();
+    return madvise(addr, length, advice) ? -errno : 0;
+}
+
+ssize_t host_syscall_SYS_write(int fd, const void *buf, size_t count) {
+    return write(fd, buf, count);
+}
+
+long lkl_syscall_lkl(long no, long *params) {
+    long ret;
+
+    switch (no) {
+        case __lkl__NR_lseek:
+            ret = lseek(params[0], params[1], params[2]);
+            break;
+        case __lkl__NR_read:
+            ret = read(params[0], (void *) params[1], params[2]);
+            break;
+        case __lkl__NR_write:
+            ret = write(params[0], (const void *) params[1], params[2]);
+            break;
+        case __lkl__NR_readv:
+            ret = readv(params[0], (const struct iovec *) params[1], params[2]);
+            break;
+        case __lkl__NR_writev:
+            ret = writev(params[0], (const struct iovec *) params[1], params[2]);
+            break;
+        case __lkl__NR_pread64:
+            ret = pread(params[0], (void *) params[1], params[2], params[3]);
+            break;
+        case __lkl__NR_pwrite64:
+            ret = pwrite(params[0], (const void *) params[1], params[2], params[3]);
+            break;
+        case __lkl__NR_preadv:
+            ret = preadv(params[0], (const struct iovec *) params[1], params[2], params[3]);
+            break;
+        case __lkl__NR_pwritev:
+            ret = pwritev(params[0], (const struct iovec *) params[1], params[2], params[3]);
+            break;
+        default:
+            return -ENOSYS;
+    }
+    return ret < 0 ? -errno : ret;
+}
+
+long lkl_sys_dup(unsigned int fd) {
+    long ret = dup(fd);
+    return ret < 0 ? -errno : ret;
+}
+
+long lkl_sys_close(unsigned int fd) {
+    return close(fd) ? -errno : 0;
+}
+
+long lkl_sys_fstat(unsigned int fd, struct lkl_stat *stat) {
+    struct stat st;
+
+    if (fstat(fd, &st))
+        return -errno;
+    stat->st_dev = st.st_dev;
+    stat->st_ino = st.st_ino;
+    stat->st_size = st.st_size;
+    stat->st_mode = st.st_mode;
+    return 0;
+}
+
+long lkl_sys_fdatasync(unsigned int fd) {
+    return fdatasync(fd) ? -errno : 0;
+}
+
+/* Sets up an enclave mmap range of num_pages pages. */
+static void enclave_mem_test_init(size_t num_pages) {
+    void *base = aligned_alloc(PAGE_SIZE, num_pages * PAGE_SIZE);
+
+    assert(base);
+    memset(base, 0, num_pages * PAGE_SIZE);
+    enclave_mman_init(base, num_pages);
+}
+
+#endif /* ENCLAVE_MEM_TEST_H */
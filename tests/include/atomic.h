@@ -0,0 +1,23 @@
+/* Stand-in for the atomic.h of sgx-lkl-musl, based on GCC builtins. */
+
+#ifndef _ATOMIC_H
+#define _ATOMIC_H
+
+#include <stdint.h>
+
+static inline void a_crash(void) { __builtin_trap(); }
+static inline void a_spin(void) { __asm__ __volatile__("pause" ::: "memory"); }
+static inline void a_barrier(void) { __sync_synchronize(); }
+static inline int a_cas(volatile int *p, int t, int s) { return __sync_val_compare_and_swap(p, t, s); }
+static inline void *a_cas_p(volatile void *p, void *t, void *s) { return __sync_val_compare_and_swap((void **) p, t, s); }
+static inline int a_swap(volatile int *p, int v) { return __sync_lock_test_and_set(p, v); }
+static inline uint64_t a_cas_64(volatile uint64_t *p, uint64_t t, uint64_t s) { return __sync_val_compare_and_swap(p, t, s); }
+static inline int a_fetch_add(volatile int *p, int v) { return __sync_fetch_and_add(p, v); }
+static inline unsigned a_fetch_add_uint(volatile unsigned *p, unsigned v) { return __sync_fetch_and_add(p, v); }
+static inline void a_inc(volatile int *p) { __sync_fetch_and_add(p, 1); }
+static inline void a_dec(volatile int *p) { __sync_fetch_and_sub(p, 1); }
+static inline void a_store(volatile int *p, int v) { __atomic_store_n(p, v, __ATOMIC_SEQ_CST); }
+static inline void a_or(volatile int *p, int v) { __sync_fetch_and_or(p, v); }
+static inline void a_and(volatile int *p, int v) { __sync_fetch_and_and(p, v); }
+
+#endif /* _ATOMIC_H */
@@ -0,0 +1,11 @@
+/* Stand-in for the futex.h of sgx-lkl-musl. */
+
+#ifndef _FUTEX_H
+#define _FUTEX_H
+
+#include <linux/futex.h>
+
+#define FUTEX_PRIVATE FUTEX_PRIVATE_FLAG
+#define FUTEX_BITSET_MATCH_ANY 0xffffffff
+
+#endif /* _FUTEX_H */
@@ -0,0 +1,23 @@
+/* Stand-in for the libc.h of sgx-lkl-musl. */
+
+#ifndef _LIBC_H
+#define _LIBC_H
+
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct __libc {
+    int threaded;
+    volatile int threads_minus_1;
+    struct __locale_struct *global_locale_p;
+    struct __locale_struct global_locale;
+};
+
+extern struct __libc __libc;
+#define libc __libc
+
+#define weak_alias(old, new) \
+    extern __typeof(old) new __attribute__((weak, alias(#old)))
+
+#endif /* _LIBC_H */
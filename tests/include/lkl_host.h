@@ -0,0 +1,52 @@
+/*
+ * Stand-in for the lkl_host.h of the LKL build. Only declares the LKL system
+ * calls used by the sources under test, which the tests implement on top of
+ * the host's or stub out.
+ */
+
+#ifndef _LKL_HOST_H
+#define _LKL_HOST_H
+
+struct lkl_stat {
+    unsigned long st_dev;
+    unsigned long st_ino;
+    long st_size;
+    unsigned int st_mode;
+};
+
+/* LKL system call numbers (asm-generic) of the system calls used by tests */
+#define __lkl__NR_lseek 62
+#define __lkl__NR_read 63
+#define __lkl__NR_write 64
+#define __lkl__NR_readv 65
+#define __lkl__NR_writev 66
+#define __lkl__NR_pread64 67
+#define __lkl__NR_pwrite64 68
+#define __lkl__NR_preadv 69
+#define __lkl__NR_pwritev 70
+#define __lkl__NR_clock_nanosleep 115
+#define __lkl__NR_sched_setparam 118
+#define __lkl__NR_sched_setscheduler 119
+#define __lkl__NR_sched_getscheduler 120
+#define __lkl__NR_sched_getparam 121
+#define __lkl__NR_sched_setaffinity 122
+#define __lkl__NR_sched_getaffinity 123
+#define __lkl__NR_sched_yield 124
+#define __lkl__NR_sched_get_priority_max 125
+#define __lkl__NR_sched_get_priority_min 126
+#define __lkl__NR_sched_rr_get_interval 127
+#define __lkl__NR_getcpu 168
+#define __lkl__NR_getpid 172
+#define __lkl__NR_getppid 173
+#define __lkl__NR_gettid 178
+#define __lkl__NR_madvise 233
+#define __lkl__NR_membarrier 283
+
+long lkl_syscall(long no, long *params);
+long lkl_syscall_lkl(long no, long *params);
+long lkl_sys_dup(unsigned int fd);
+long lkl_sys_close(unsigned int fd);
+long lkl_sys_fstat(unsigned int fd, struct lkl_stat *stat);
+long lkl_sys_fdatasync(unsigned int fd);
+
+#endif /* _LKL_HOST_H */
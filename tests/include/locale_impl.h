@@ -0,0 +1,3 @@
+/* Stand-in for the locale_impl.h of sgx-lkl-musl. */
+
+#include <locale.h>
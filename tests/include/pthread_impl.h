@@ -0,0 +1,46 @@
+/*
+ * Stand-in for the pthread_impl.h of sgx-lkl-musl. Provides the scheduler
+ * context and the mutex field names used by SGX-LKL on top of the host's
+ * pthread types.
+ */
+
+#ifndef _PTHREAD_IMPL_H
+#define _PTHREAD_IMPL_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+
+struct lthread;
+
+#include "lthread.h"
+#include "lthread_int.h"
+
+struct __ptcb {
+    void (*__f)(void *);
+    void *__x;
+    struct __ptcb *__next;
+};
+
+struct schedctx {
+    struct schedctx *self;
+    struct lthread_sched sched;
+};
+
+struct schedctx *__scheduler_self(void);
+
+static inline struct lthread_sched *lthread_get_sched(void) {
+    return &__scheduler_self()->sched;
+}
+
+void __wake(volatile void *addr, int cnt, int priv);
+void futex_tick(void);
+
+#define _m_next     __data.__list.__next
+#define _m_waiters  __data.__count
+#define _m_type     __data.__kind
+#define _m_lock     __data.__lock
+#define _m_count    __data.__owner
+
+#endif /* _PTHREAD_IMPL_H */
@@ -0,0 +1,14 @@
+/* Stand-in for the stdio_impl.h of sgx-lkl-musl. */
+
+#ifndef _STDIO_IMPL_H
+#define _STDIO_IMPL_H
+
+#include <stdio.h>
+
+FILE **__ofl_lock(void);
+void __ofl_unlock(void);
+
+#define lock _flags2
+#define next _chain
+
+#endif /* _STDIO_IMPL_H */
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2016, 2017, 2018 Imperial College London
+ */
+
+/*
+ * Builds src/sched/lthread.c on the host for unit tests of functions that do
+ * not switch contexts. There is a single ethread whose scheduler has not
+ * started; tests set current_lthread themselves. Enclave memory and syscall
+ * slots are provided by the host.
+ */
+
+#ifndef LTHREAD_TEST_H
+#define LTHREAD_TEST_H
+
+#include "pthread_impl.h"
+#include "../src/sched/lthread.c"
+
+#include <assert.h>
+#include <sys/syscall.h>
+
+struct __libc __libc;
+static struct schedctx test_schedctx;
+
+struct schedctx *__scheduler_self(void) {
+    return &test_schedctx;
+}
+
+void __wake(volatile void *addr, int cnt, int priv) {}
+void futex_tick(void) {}
+
+FILE **__ofl_lock(void) {
+    static FILE *head;
+    return &head;
+}
+
+void __ofl_unlock(void) {}
+
+int __copy_utls(uint8_t **itls, size_t *itlssz) {
+    *itls = NULL;
+    *itlssz = 0;
+    return 1;
+}
+
+size_t allocslot(struct lthread *lt) { return 0; }
+void freeslot(size_t slotno) {}
+struct lthread *slottolthread(size_t s) { return NULL; }
+
+void arena_new(Arena *a, size_t size) {
+    a->mem = malloc(size);
+    a->size = size;
+    a->allocated = 0;
+}
+
+void arena_free(Arena *a) {
+    a->allocated = 0;
+}
+
+void arena_destroy(Arena *a) {
+    free(a->mem);
+    a->mem = NULL;
+}
+
+void *enclave_mmap(void *addr, size_t length, int mmap_fixed) {
+    return mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+}
+
+int enclave_munmap(void *addr, size_t length) {
+    return munmap(addr, length);
+}
+
+void enclave_mmap_zero_idle(void) {}
+
+int host_syscall_SYS_madvise(void *addr, size_t length, int advice) {
+    return madvise(addr, length, advice) ? -errno : 0;
+}
+
+int host_syscall_SYS_membarrier(int cmd, int flags) {
+    return syscall(SYS_membarrier, cmd, flags) ? -errno : 0;
+}
+
+pid_t host_syscall_SYS_gettid(void) {
+    return syscall(SYS_gettid);
+}
+
+int host_syscall_SYS_nanosleep(const struct timespec *req, struct timespec *rem) {
+    return nanosleep(req, rem) ? -errno : 0;
+}
+
+ssize_t host_syscall_SYS_write(int fd, const void *buf, size_t count) {
+    return write(fd, buf, count);
+}
+
+/* Sets up the scheduler of the only ethread, see _lthread_sched_init. */
+static void lthread_test_init(void) {
+    struct lthread_sched *sched = lthread_get_sched();
+
+    libc.threaded = 1;
+    sched->stack_size = 64 * 1024;
+    sched->page_size = PAGE_SIZE;
+    newmpmcq(&__scheduler_queue, 1024 * sizeof(struct cell_t), NULL);
+}
+
+#endif /* LTHREAD_TEST_H */
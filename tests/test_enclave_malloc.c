@@ -0,0 +1,89 @@
+/*
+ * Copyright 2016, 2017, 2018 Imperial College London
+ */
+
+/* Size classes and caches of the multi-arena allocator. */
+
+#include "pthread_impl.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Keep the host's malloc for the test itself.
+#define SGXLKL_ARENA_MALLOC
+#define malloc test_malloc
+#define free test_free
+#define calloc test_calloc
+#define realloc test_realloc
+#define aligned_alloc test_aligned_alloc
+#define posix_memalign test_posix_memalign
+#define memalign test_memalign
+#define malloc_usable_size test_malloc_usable_size
+#include "../src/sgx/enclave_malloc.c"
+
+static struct schedctx test_schedctx;
+
+struct schedctx *__scheduler_self(void) {
+    return &test_schedctx;
+}
+
+int main(void) {
+    void *p, *q, *ptrs[1000];
+    unsigned cls;
+    size_t n;
+    int i;
+
+    // Every size maps to the smallest class that holds it, and payloads of
+    // consecutive blocks stay aligned.
+    for (n = 0; n <= MALLOC_MAX_SMALL; n++) {
+        cls = size_to_class(n);
+        assert(cls < MALLOC_NUM_CLASSES);
+        assert(class_size(cls) >= n);
+        assert(cls == 0 || class_size(cls - 1) < n);
+        assert(block_size(cls) % MALLOC_ALIGN == 0);
+    }
+    assert(class_size(MALLOC_NUM_CLASSES - 1) == MALLOC_MAX_SMALL);
+
+    // Without a scheduler, blocks come from the first arena.
+    test_schedctx.sched.ethread_id = -1;
+    p = malloc(100);
+    assert(p && (uintptr_t) p % MALLOC_ALIGN == 0 && malloc_usable_size(p) >= 100);
+    free(p);
+    assert(arenas[0].head[size_to_class(100)] == (struct free_block *) ptr_to_chunk(p));
+    assert(!tcaches[0]);
+
+    // Freed blocks are reused from the cache of the ethread.
+    test_schedctx.sched.ethread_id = 3;
+    p = malloc(200);
+    assert(tcaches[3]);
+    free(p);
+    assert(malloc(200) == p);
+    for (i = 0; i < 1000; i++)
+        ptrs[i] = malloc(64);
+    for (i = 0; i < 1000; i++)
+        free(ptrs[i]);
+    assert(tcaches[3]->count[size_to_class(64)] <= cache_limit(size_to_class(64)));
+
+    // Large blocks are mapped and resized by mremap.
+    p = malloc(MALLOC_MAX_SMALL + 1);
+    assert(ptr_to_chunk(p)->cls == CLASS_LARGE);
+    memset(p, 7, MALLOC_MAX_SMALL + 1);
+    q = realloc(p, 4 * MALLOC_MAX_SMALL);
+    assert(q && ((char *) q)[MALLOC_MAX_SMALL] == 7);
+    free(q);
+
+    p = calloc(10, 1000);
+    for (n = 0; n < 10000; n++)
+        assert(((char *) p)[n] == 0);
+    free(p);
+    assert(!calloc(SIZE_MAX / 2, 4) && errno == ENOMEM);
+
+    p = aligned_alloc(65536, 100);
+    assert(p && (uintptr_t) p % 65536 == 0);
+    free(p);
+    assert(posix_memalign(&p, 3, 100) == EINVAL);
+
+    printf("test_enclave_malloc: ok\n");
+    return 0;
+}
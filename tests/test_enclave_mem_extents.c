@@ -0,0 +1,97 @@
+/*
+ * Copyright 2016, 2017, 2018 Imperial College London
+ */
+
+/* Index of free extents of the enclave mmap range. */
+
+#include "enclave_mem_test.h"
+
+#define NUM_PAGES 16384
+#define NUM_MAPPINGS 1000
+
+/* Checks that the extent index describes exactly the free pages of the bitmap. */
+static void check_extents(void) {
+    struct mmap_extent *e;
+    size_t i, end = 0, free_pages = 0, by_addr = 0, by_size = 0;
+
+    assert(extents_valid);
+    RB_FOREACH(e, mmap_extent_addr, &extents_by_addr) {
+        assert(e->pages > 0);
+        // Adjacent extents are coalesced.
+        assert(by_addr == 0 || e->index > end);
+        for (i = e->index; i < e->index + e->pages; i++)
+            assert(!page_bit(mmap_bitmap, i));
+        assert(e->index == 0 || page_bit(mmap_bitmap, e->index - 1));
+        assert(e->index + e->pages == mmap_num_pages || page_bit(mmap_bitmap, e->index + e->pages));
+        end = e->index + e->pages;
+        free_pages += e->pages;
+        by_addr++;
+    }
+    RB_FOREACH(e, mmap_extent_size, &extents_by_size)
+        by_size++;
+    assert(by_addr == by_size);
+    for (i = 0; i < mmap_num_pages; i++)
+        free_pages -= !page_bit(mmap_bitmap, i);
+    assert(free_pages == 0);
+}
+
+int main(void) {
+    void *addrs[NUM_MAPPINGS] = {0};
+    size_t lengths[NUM_MAPPINGS], pages, index, expected, i;
+    struct mmap_extent *e, *best;
+    void *addr;
+    int it, k;
+
+    enclave_mem_test_init(NUM_PAGES);
+    srand(1);
+
+    for (it = 0; it < 100000; it++) {
+        k = rand() % NUM_MAPPINGS;
+        if (addrs[k]) {
+            assert(enclave_munmap(addrs[k], lengths[k]) == 0);
+            addrs[k] = NULL;
+        } else if (rand() % 20 == 0) {
+            // Fixed mappings may replace others, which are still unmapped later.
+            pages = 1 + rand() % 8;
+            index = rand() % (mmap_num_pages - pages);
+            addr = index_to_addr(index + pages - 1);
+            assert(enclave_mmap(addr, pages * PAGE_SIZE, 1) == addr);
+            assert(enclave_munmap(addr, pages * PAGE_SIZE) == 0);
+        } else {
+            pages = 1 + (rand() % 16 ? rand() % 4 : rand() % 200);
+            lengths[k] = pages * PAGE_SIZE;
+            // Mappings are taken from the low address end of the smallest free
+            // extent that fits, unless a page is taken for extent nodes first.
+            best = NULL;
+            RB_FOREACH(e, mmap_extent_addr, &extents_by_addr)
+                if (e->pages >= pages && (!best || e->pages < best->pages))
+                    best = e;
+            expected = best && extent_free_count >= 2 ? best->index + best->pages - pages : SIZE_MAX;
+            if ((addrs[k] = enclave_mmap(0, lengths[k], 0)) == MAP_FAILED) {
+                assert(!best);
+                addrs[k] = NULL;
+                continue;
+            }
+            assert(expected == SIZE_MAX || addr_to_index(addrs[k]) - (pages - 1) == expected);
+        }
+        if (it % 97 == 0)
+            check_extents();
+    }
+    for (k = 0; k < NUM_MAPPINGS; k++)
+        if (addrs[k])
+            enclave_munmap(addrs[k], lengths[k]);
+    check_extents();
+
+    // Nodes are allocated from free pages, which may be inaccessible.
+    addr = syscall_SYS_mmap(0, mmap_num_pages * PAGE_SIZE / 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(addr != MAP_FAILED);
+    assert(syscall_SYS_munmap(addr, mmap_num_pages * PAGE_SIZE / 2) == 0);
+    for (i = 0; i < mmap_num_pages / 2; i++)
+        assert(enclave_mmap(0, PAGE_SIZE, 0) != MAP_FAILED);
+    for (i = 0; i < mmap_num_pages / 2; i += 2)
+        enclave_munmap(index_to_addr(mmap_num_pages - 1 - i), PAGE_SIZE);
+    check_extents();
+
+    printf("test_enclave_mem_extents: ok\n");
+    return 0;
+}
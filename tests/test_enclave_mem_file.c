@@ -0,0 +1,74 @@
+/*
+ * Copyright 2016, 2017, 2018 Imperial College London
+ */
+
+/* Coherence of shared file mappings with read and write system calls. */
+
+#include "enclave_mem_test.h"
+
+#include <stdlib.h>
+
+#define NUM_PAGES 64
+
+static long file_io(long no, long a1, long a2, long a3, long a4) {
+    long params[6] = {a1, a2, a3, a4, 0, 0};
+    return enclave_mmap_file_io(no, params);
+}
+
+int main(void) {
+    char path[] = "/tmp/test_enclave_mem_file.XXXXXX";
+    char buf[PAGE_SIZE], *ro, *rw;
+    struct iovec iov = {buf, 2};
+    int fd;
+
+    enclave_mem_test_init(NUM_PAGES);
+    sgxlkl_mmap_file_support = 1;
+
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+    memset(buf, 'a', sizeof(buf));
+    assert(write(fd, buf, PAGE_SIZE) == PAGE_SIZE && write(fd, buf, PAGE_SIZE) == PAGE_SIZE);
+
+    ro = syscall_SYS_mmap(0, 2 * PAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    rw = syscall_SYS_mmap(0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, PAGE_SIZE);
+    assert(ro != MAP_FAILED && rw != MAP_FAILED);
+    assert(ro[0] == 'a' && ro[PAGE_SIZE] == 'a' && rw[0] == 'a');
+
+    // A pwrite is visible through all mappings of the range, including
+    // read-only ones.
+    assert(file_io(__lkl__NR_pwrite64, fd, (long) "bc", 2, PAGE_SIZE + 10) == 2);
+    assert(ro[PAGE_SIZE + 10] == 'b' && ro[PAGE_SIZE + 11] == 'c');
+    assert(rw[10] == 'b' && rw[11] == 'c');
+    assert(mmap_prot[addr_to_index(ro + PAGE_SIZE)] == PROT_READ);
+
+    // So is a write at the file position.
+    assert(lseek(fd, 5, SEEK_SET) == 5);
+    assert(file_io(__lkl__NR_write, fd, (long) "d", 1, 0) == 1);
+    assert(ro[5] == 'd' && ro[4] == 'a');
+
+    // A read sees stores through a writable mapping, and a writeback of the
+    // mapping refreshes the other mappings of the file.
+    rw[20] = 'e';
+    assert(file_io(__lkl__NR_pread64, fd, (long) buf, 1, PAGE_SIZE + 20) == 1 && buf[0] == 'e');
+    assert(ro[PAGE_SIZE + 20] == 'e');
+    rw[30] = 'f';
+    rw[31] = 'g';
+    assert(lseek(fd, PAGE_SIZE + 30, SEEK_SET) == PAGE_SIZE + 30);
+    assert(file_io(__lkl__NR_readv, fd, (long) &iov, 1, 0) == 2 && buf[0] == 'f' && buf[1] == 'g');
+
+    // Writes to parts of the file that are not mapped leave mappings alone.
+    assert(file_io(__lkl__NR_pwrite64, fd, (long) "h", 1, 3 * PAGE_SIZE) == 1);
+    assert(ro[PAGE_SIZE - 1] == 'a' && ro[2 * PAGE_SIZE - 1] == 'a');
+
+    assert(syscall_SYS_munmap(ro, 2 * PAGE_SIZE) == 0);
+    assert(syscall_SYS_munmap(rw, PAGE_SIZE) == 0);
+    assert(SLIST_EMPTY(&file_mappings));
+
+    // Without mappings, calls are passed through.
+    assert(file_io(__lkl__NR_pread64, fd, (long) buf, 1, 5) == 1 && buf[0] == 'd');
+
+    close(fd);
+    printf("test_enclave_mem_file: ok\n");
+    return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright 2016, 2017, 2018 Imperial College London
+ */
+
+/* Growing, shrinking and moving enclave mappings with mremap. */
+
+#include "enclave_mem_test.h"
+
+#define NUM_PAGES 4096
+#define NUM_MAPPINGS 300
+
+static void *map(size_t pages, int prot) {
+    void *addr = syscall_SYS_mmap(0, pages * PAGE_SIZE, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(addr != MAP_FAILED);
+    return addr;
+}
+
+static void *remap(void *addr, size_t old_pages, size_t new_pages, int flags) {
+    return syscall_SYS_mremap(addr, old_pages * PAGE_SIZE, new_pages * PAGE_SIZE, flags, 0);
+}
+
+static int all(const char *p, size_t length, char c) {
+    size_t i;
+
+    for (i = 0; i < length; i++)
+        if (p[i] != c)
+            return 0;
+    return 1;
+}
+
+static int prot_of(void *addr) {
+    return mmap_prot[addr_to_index(addr)];
+}
+
+int main(void) {
+    char *a, *b, *c, *addrs[NUM_MAPPINGS] = {0};
+    size_t pages[NUM_MAPPINGS], keep, n;
+    int prots[NUM_MAPPINGS], it, k;
+    char fill[NUM_MAPPINGS];
+
+    enclave_mem_test_init(NUM_PAGES);
+
+    // Pages added in place are zeroed even if they were used before.
+    a = map(4, PROT_READ | PROT_WRITE);
+    memset(a, 1, 4 * PAGE_SIZE);
+    assert(syscall_SYS_munmap(a + 2 * PAGE_SIZE, 2 * PAGE_SIZE) == 0);
+    assert(remap(a, 2, 4, 0) == a);
+    assert(all(a, 2 * PAGE_SIZE, 1) && all(a + 2 * PAGE_SIZE, 2 * PAGE_SIZE, 0));
+    memset(a + 2 * PAGE_SIZE, 2, 2 * PAGE_SIZE);
+
+    // Mappings that cannot grow in place are only moved with MREMAP_MAYMOVE.
+    b = map(1, PROT_READ | PROT_WRITE);
+    assert(b == a + 4 * PAGE_SIZE);
+    assert(remap(a, 4, 6, 0) == MAP_FAILED && errno == ENOMEM);
+    c = remap(a, 4, 6, MREMAP_MAYMOVE);
+    assert(c != MAP_FAILED && c != a);
+    assert(all(c, 2 * PAGE_SIZE, 1) && all(c + 2 * PAGE_SIZE, 2 * PAGE_SIZE, 2));
+    assert(all(c + 4 * PAGE_SIZE, 2 * PAGE_SIZE, 0));
+    assert(page_bit(mmap_bitmap, addr_to_index(b)) && !page_bit(mmap_bitmap, addr_to_index(a)));
+    memset(c + 4 * PAGE_SIZE, 3, 2 * PAGE_SIZE);
+
+    // Added pages get the protection of the last page, moved pages keep theirs.
+    assert(syscall_SYS_mprotect(c + 5 * PAGE_SIZE, PAGE_SIZE, PROT_READ) == 0);
+    a = remap(c, 6, 8, MREMAP_MAYMOVE);
+    assert(a != MAP_FAILED);
+    assert(prot_of(a) == (PROT_READ | PROT_WRITE) && prot_of(a + 5 * PAGE_SIZE) == PROT_READ);
+    assert(prot_of(a + 6 * PAGE_SIZE) == PROT_READ && prot_of(a + 7 * PAGE_SIZE) == PROT_READ);
+    assert(all(a + 4 * PAGE_SIZE, 2 * PAGE_SIZE, 3) && all(a + 6 * PAGE_SIZE, 2 * PAGE_SIZE, 0));
+
+    // Inaccessible mappings grow by reservation and read zero once committed.
+    c = map(2, PROT_NONE);
+    assert(page_bit(mmap_reserved_bitmap, addr_to_index(c)));
+    c = remap(c, 2, 5, MREMAP_MAYMOVE);
+    assert(c != MAP_FAILED && page_bit(mmap_reserved_bitmap, addr_to_index(c + 4 * PAGE_SIZE)));
+    assert(syscall_SYS_mprotect(c, 5 * PAGE_SIZE, PROT_READ) == 0);
+    assert(all(c, 5 * PAGE_SIZE, 0));
+
+    // Shrinking unmaps the tail, a zero old length is invalid.
+    assert(remap(a, 8, 3, 0) == a);
+    assert(!page_bit(mmap_bitmap, addr_to_index(a + 3 * PAGE_SIZE)));
+    assert(remap(a, 0, 1, MREMAP_MAYMOVE) == MAP_FAILED && errno == EINVAL);
+
+    // Contents survive random resizing, added pages read zero.
+    srand(5);
+    for (it = 0; it < 20000; it++) {
+        k = rand() % NUM_MAPPINGS;
+        if (!addrs[k]) {
+            pages[k] = 1 + rand() % 8;
+            prots[k] = rand() % 2 ? PROT_READ | PROT_WRITE : PROT_READ;
+            addrs[k] = syscall_SYS_mmap(0, pages[k] * PAGE_SIZE, prots[k], MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (addrs[k] == MAP_FAILED) {
+                addrs[k] = NULL;
+                continue;
+            }
+            assert(all(addrs[k], pages[k] * PAGE_SIZE, 0));
+            fill[k] = 0;
+            if (prots[k] & PROT_WRITE) {
+                fill[k] = 1 + rand() % 100;
+                memset(addrs[k], fill[k], pages[k] * PAGE_SIZE);
+            }
+        } else if (rand() % 2) {
+            n = 1 + rand() % 16;
+            a = remap(addrs[k], pages[k], n, MREMAP_MAYMOVE);
+            if (a == MAP_FAILED)
+                continue;
+            keep = n < pages[k] ? n : pages[k];
+            assert(all(a, keep * PAGE_SIZE, fill[k]));
+            assert(n <= keep || all(a + keep * PAGE_SIZE, (n - keep) * PAGE_SIZE, 0));
+            addrs[k] = a;
+            pages[k] = n;
+            // Read-only mappings stay zero.
+            if (prots[k] & PROT_WRITE)
+                memset(a, fill[k], n * PAGE_SIZE);
+        } else {
+            assert(syscall_SYS_munmap(addrs[k], pages[k] * PAGE_SIZE) == 0);
+            addrs[k] = NULL;
+        }
+        if (rand() % 5 == 0)
+            enclave_mmap_zero_idle();
+    }
+
+    printf("test_enclave_mem_mremap: ok\n");
+    return 0;
+}
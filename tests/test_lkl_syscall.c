@@ -0,0 +1,107 @@
+/*
+ * Copyright 2016, 2017, 2018 Imperial College London
+ */
+
+/* System calls served within the enclave by lkl_syscall(). */
+
+#include "lthread_test.h"
+#include "../src/lkl/syscall.c"
+
+static int lkl_calls, madvise_calls, file_io_calls;
+
+long lkl_syscall_lkl(long no, long *params) {
+    lkl_calls++;
+    return -ENOSYS;
+}
+
+pid_t syscall_SYS_getpid(void) {
+    return 42;
+}
+
+int syscall_SYS_madvise(void *addr, size_t length, int advice) {
+    madvise_calls++;
+    return 0;
+}
+
+long enclave_mmap_file_io(long no, long *params) {
+    file_io_calls++;
+    return 0;
+}
+
+int main(void) {
+    struct lthread lt = {0};
+    struct sched_param param = {.sched_priority = 10};
+    struct timespec ts = {0, 1000};
+    cpu_set_t set;
+    unsigned cpu = 99;
+    long params[6] = {0};
+
+    lthread_test_init();
+    lt.tid = 7;
+    // Pinned lthreads do not switch to the scheduler when they yield or sleep.
+    lt.attr.state = BIT(LT_ST_PINNED);
+    lthread_get_sched()->current_lthread = &lt;
+
+    assert(lkl_syscall(__lkl__NR_getpid, params) == 42);
+    assert(lkl_syscall(__lkl__NR_gettid, params) == 7);
+    assert(lkl_syscall(__lkl__NR_sched_yield, params) == 0);
+
+    params[0] = (long) &cpu;
+    assert(lkl_syscall(__lkl__NR_getcpu, params) == 0 && cpu == 0);
+
+    params[0] = SCHED_RR;
+    assert(lkl_syscall(__lkl__NR_sched_get_priority_max, params) == 99);
+    assert(lkl_syscall(__lkl__NR_sched_get_priority_min, params) == 1);
+
+    params[0] = 0;
+    params[1] = SCHED_FIFO;
+    params[2] = (long) &param;
+    assert(lkl_syscall(__lkl__NR_sched_setscheduler, params) == 0);
+    assert(lt.attr.priority == LTHREAD_PRIO_HIGH);
+    params[0] = lt.tid;
+    assert(lkl_syscall(__lkl__NR_sched_getscheduler, params) == SCHED_FIFO);
+    params[0] = lt.tid + 1;
+    assert(lkl_syscall(__lkl__NR_sched_getscheduler, params) == -ESRCH);
+
+    params[0] = 0;
+    params[1] = (long) &param;
+    assert(lkl_syscall(__lkl__NR_sched_getparam, params) == 0 && param.sched_priority == 1);
+    assert(lkl_syscall(__lkl__NR_sched_setparam, params) == 0);
+    params[1] = (long) &ts;
+    assert(lkl_syscall(__lkl__NR_sched_rr_get_interval, params) == 0);
+
+    params[0] = 0;
+    params[1] = sizeof(set);
+    params[2] = (long) &set;
+    assert(lkl_syscall(__lkl__NR_sched_getaffinity, params) == sizeof(set));
+    assert(CPU_COUNT(&set) == 1 && CPU_ISSET(0, &set));
+    assert(lkl_syscall(__lkl__NR_sched_setaffinity, params) == 0);
+
+    params[0] = CLOCK_MONOTONIC;
+    params[1] = 0;
+    params[2] = (long) &ts;
+    params[3] = 0;
+    assert(lkl_syscall(__lkl__NR_clock_nanosleep, params) == 0);
+    params[0] = CLOCK_PROCESS_CPUTIME_ID;
+    assert(lkl_syscall(__lkl__NR_clock_nanosleep, params) == -EINVAL);
+
+    params[0] = MEMBARRIER_CMD_QUERY;
+    params[1] = 0;
+    assert(lkl_syscall(__lkl__NR_membarrier, params) & MEMBARRIER_CMD_GLOBAL);
+
+    params[0] = 0;
+    params[1] = 4096;
+    params[2] = MADV_DONTNEED;
+    assert(lkl_syscall(__lkl__NR_madvise, params) == 0 && madvise_calls == 1);
+
+    // File reads and writes are checked against shared file mappings.
+    assert(lkl_syscall(__lkl__NR_pwrite64, params) == 0 && file_io_calls == 1);
+    assert(lkl_syscall(__lkl__NR_read, params) == 0 && file_io_calls == 2);
+
+    // All other system calls are served by LKL.
+    assert(lkl_calls == 0);
+    assert(lkl_syscall(__lkl__NR_getppid, params) == -ENOSYS && lkl_calls == 1);
+
+    printf("test_lkl_syscall: ok\n");
+    return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2016, 2017, 2018 Imperial College London
+ */
+
+/* Reuse of the shells of freed lthreads by lthread_create. */
+
+#include "lthread_test.h"
+
+#define ROUNDUP(x) (((x) + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE)
+
+static void fn(void *arg) {}
+
+static struct lthread *create(size_t stack_size) {
+    struct lthread_attr attr = {0};
+    struct lthread *lt;
+    void *queued;
+
+    attr.stack_size = stack_size;
+    assert(lthread_create(&lt, &attr, fn, NULL) == 0);
+    assert(mpmc_dequeue(&__scheduler_queue, &queued) && queued == lt);
+    assert(lt->stack_owned && lt->attr.stack_size == ROUNDUP(stack_size));
+    return lt;
+}
+
+static size_t cached(size_t stack_size) {
+    int i;
+
+    for (i = 0; i < LTHREAD_CACHE_BUCKETS; i++)
+        if (lthread_cache[i].count && lthread_cache[i].stack_size == stack_size)
+            return lthread_cache[i].count;
+    return 0;
+}
+
+int main(void) {
+    struct lthread *lt, *lts[LTHREAD_CACHE_MAX + 1];
+    void *stack;
+    int i, tid;
+
+    lthread_test_init();
+
+    // A freed shell is reused with its stack and gets a new tid.
+    lt = create(64 * 1024);
+    stack = lt->attr.stack;
+    tid = lt->tid;
+    lt->tls_direct = calloc(LTHREAD_TLS_DIRECT_KEYS, sizeof(void *));
+    _lthread_free(lt);
+    assert(cached(64 * 1024) == 1);
+    assert(lt->tls_direct == NULL);
+    assert(create(64 * 1024) == lt);
+    assert(lt->attr.stack == stack && lt->tid != tid);
+    assert(cached(64 * 1024) == 0);
+
+    // Shells are only reused for the same stack size.
+    _lthread_free(lt);
+    assert(create(128 * 1024) != lt);
+    assert(create(64 * 1024) == lt);
+
+    // Stack sizes are rounded up to whole pages.
+    _lthread_free(lt);
+    assert(create(64 * 1024 - 100) == lt);
+
+    // Each bucket holds up to LTHREAD_CACHE_MAX shells.
+    for (i = 0; i <= LTHREAD_CACHE_MAX; i++)
+        lts[i] = create(32 * 1024);
+    for (i = 0; i <= LTHREAD_CACHE_MAX; i++)
+        _lthread_free(lts[i]);
+    assert(cached(32 * 1024) == LTHREAD_CACHE_MAX);
+
+    // Stack sizes beyond the number of buckets are not cached.
+    for (i = 1; i <= LTHREAD_CACHE_BUCKETS + 1; i++)
+        _lthread_free(create(i * 256 * 1024));
+    assert(cached(LTHREAD_CACHE_BUCKETS * 256 * 1024) == 0);
+
+    printf("test_lthread_cache: ok\n");
+    return 0;
+}
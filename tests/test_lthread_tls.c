@@ -0,0 +1,69 @@
+/*
+ * Copyright 2016, 2017, 2018 Imperial College London
+ */
+
+/* TLS keys of lthreads, both directly indexed and list based ones. */
+
+#include "lthread_test.h"
+
+#define NUM_KEYS (LTHREAD_TLS_DIRECT_KEYS + 8)
+
+static int destructed[NUM_KEYS];
+
+static void destructor(void *data) {
+    destructed[(int *) data - destructed]++;
+}
+
+int main(void) {
+    struct lthread lt1 = {0}, lt2 = {0};
+    pthread_key_t keys[NUM_KEYS], key;
+    int i;
+
+    lthread_test_init();
+    LIST_INIT(&lt1.tls);
+    LIST_INIT(&lt2.tls);
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        assert(lthread_key_create(&keys[i], destructor) == 0);
+        assert(keys[i] == i);
+    }
+
+    // Values are per lthread and NULL until set.
+    lthread_get_sched()->current_lthread = &lt1;
+    for (i = 0; i < NUM_KEYS; i++) {
+        assert(lthread_getspecific(keys[i]) == NULL);
+        assert(lthread_setspecific(keys[i], &destructed[i]) == 0);
+    }
+    lthread_get_sched()->current_lthread = &lt2;
+    assert(lt2.tls_direct == NULL);
+    assert(lthread_setspecific(keys[0], NULL) == 0);
+    assert(lt2.tls_direct == NULL);
+    for (i = 0; i < NUM_KEYS; i++)
+        assert(lthread_getspecific(keys[i]) == NULL);
+    lthread_get_sched()->current_lthread = &lt1;
+    for (i = 0; i < NUM_KEYS; i++)
+        assert(lthread_getspecific(keys[i]) == &destructed[i]);
+
+    // Deleted keys have no destructor.
+    assert(lthread_key_delete(keys[1]) == 0);
+    assert(lthread_key_delete(keys[1]) == EINVAL);
+    assert(lthread_key_delete(keys[NUM_KEYS - 1]) == 0);
+    assert(lthread_key_delete(keys[NUM_KEYS - 1]) == EINVAL);
+
+    // Direct keys are reused without the values of the deleted key.
+    for (i = 0; i < 1000; i++) {
+        assert(lthread_key_create(&key, destructor) == 0);
+        assert(key == keys[1]);
+        assert(lthread_getspecific(key) == NULL);
+        assert(lthread_key_delete(key) == 0);
+    }
+    assert(lthread_setspecific(keys[2], NULL) == 0);
+
+    lthread_rundestructors(&lt1);
+    for (i = 0; i < NUM_KEYS; i++)
+        assert(destructed[i] == (i == 1 || i == 2 || i == NUM_KEYS - 1 ? 0 : 1));
+    assert(lt1.tls_direct == NULL);
+
+    printf("test_lthread_tls: ok\n");
+    return 0;
+}